@@ -0,0 +1,398 @@
+/*
+  ==============================================================================
+
+    Headless benchmarks for the lockfree module. Results are printed as JSON,
+    or written to a file with --out=results.json. Pass --quick for a short run.
+
+  ==============================================================================
+*/
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <juce_audio_formats/juce_audio_formats.h>
+#include <juce_core/juce_core.h>
+#include <lockfree/lockfree.h>
+#include <thread>
+#include <vector>
+
+using namespace musikhack::lockfree;
+
+namespace {
+
+// A message of a given size. The first bytes carry a sequence number so the
+// consumer touches the data it reads
+template <size_t Bytes> struct Payload {
+  static_assert(Bytes >= sizeof(juce::uint64), "Payload is too small");
+
+  Payload() = default;
+  explicit Payload(juce::uint64 sequence) { setSequence(sequence); }
+
+  juce::uint64 getSequence() const {
+    return juce::readUnaligned<juce::uint64>(data.data());
+  }
+  void setSequence(juce::uint64 sequence) {
+    juce::writeUnaligned(data.data(), sequence);
+  }
+
+  std::array<char, Bytes> data{};
+};
+
+struct Settings {
+  size_t numItems = 2000000;
+  size_t numRoundTrips = 200000;
+  int numLoaderRounds = 5;
+};
+
+using Clock = std::chrono::steady_clock;
+
+double secondsSince(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Pin the calling thread to a core when there are enough of them, so the
+// producer and consumer always run in parallel
+void pinToCore(int core) {
+  if (juce::SystemStats::getNumCpus() > core)
+    juce::Thread::setCurrentThreadAffinityMask((juce::uint32)1 << core);
+}
+
+// Back off when a queue is full or empty. Without it a spinning thread can
+// starve its partner when both share a core
+void backOff() { std::this_thread::yield(); }
+
+juce::var percentiles(std::vector<double> values) {
+  auto *obj = new juce::DynamicObject();
+  if (values.empty())
+    return juce::var(obj);
+
+  std::sort(values.begin(), values.end());
+  const auto at = [&](double fraction) {
+    const auto index = (size_t)(fraction * (double)(values.size() - 1));
+    return values[index];
+  };
+
+  obj->setProperty("p50", at(0.5));
+  obj->setProperty("p90", at(0.9));
+  obj->setProperty("p99", at(0.99));
+  obj->setProperty("p999", at(0.999));
+  obj->setProperty("max", values.back());
+  return juce::var(obj);
+}
+
+juce::var result(const juce::String &benchmark, const juce::String &queue) {
+  auto *obj = new juce::DynamicObject();
+  obj->setProperty("benchmark", benchmark);
+  obj->setProperty("queue", queue);
+  return juce::var(obj);
+}
+
+//==============================================================================
+// Push numItems one at a time on one thread and pop them on another
+template <typename Fifo, typename Item>
+juce::var singleItemThroughput(const juce::String &name, Fifo &fifo,
+                               size_t capacity, const Settings &settings) {
+  const auto numItems = settings.numItems;
+  const auto start = Clock::now();
+
+  std::thread producer([&] {
+    pinToCore(1);
+    for (juce::uint64 i = 0; i < numItems; ++i) {
+      while (!fifo.push(Item(i)))
+        backOff();
+    }
+  });
+
+  pinToCore(0);
+  Item item;
+  juce::uint64 checksum = 0;
+  for (size_t i = 0; i < numItems; ++i) {
+    while (!fifo.pop(item))
+      backOff();
+    checksum += item.getSequence();
+  }
+
+  producer.join();
+  const auto seconds = secondsSince(start);
+
+  auto res = result("throughput", name);
+  res.getDynamicObject()->setProperty(
+      "valid", checksum == (juce::uint64)numItems * (numItems - 1) / 2);
+  res.getDynamicObject()->setProperty("payloadBytes", (int)sizeof(Item));
+  res.getDynamicObject()->setProperty("capacity", (juce::int64)capacity);
+  res.getDynamicObject()->setProperty("block", 1);
+  res.getDynamicObject()->setProperty("itemsPerSecond",
+                                      (double)numItems / seconds);
+  return res;
+}
+
+// Push and pop numItems floats in blocks with pushN and popN
+template <typename Fifo>
+juce::var bulkThroughput(const juce::String &name, Fifo &fifo, size_t capacity,
+                         size_t blockSize, const Settings &settings) {
+  const auto numItems = settings.numItems;
+  const auto start = Clock::now();
+
+  std::thread producer([&] {
+    pinToCore(1);
+    std::vector<float> block(blockSize);
+    size_t sent = 0;
+    while (sent < numItems) {
+      const auto toSend = std::min(blockSize, numItems - sent);
+      for (size_t i = 0; i < toSend; ++i)
+        block[i] = (float)((sent + i) & 0xffff);
+
+      const auto pushed = fifo.pushN(block.data(), toSend);
+      if (pushed == 0)
+        backOff();
+      sent += pushed;
+    }
+  });
+
+  pinToCore(0);
+  std::vector<float> block(blockSize);
+  size_t received = 0;
+  while (received < numItems) {
+    const auto popped = fifo.popN(block.data(), blockSize);
+    if (popped == 0)
+      backOff();
+    received += popped;
+  }
+
+  producer.join();
+  const auto seconds = secondsSince(start);
+
+  auto res = result("throughput", name);
+  res.getDynamicObject()->setProperty("payloadBytes", (int)sizeof(float));
+  res.getDynamicObject()->setProperty("capacity", (juce::int64)capacity);
+  res.getDynamicObject()->setProperty("block", (juce::int64)blockSize);
+  res.getDynamicObject()->setProperty("itemsPerSecond",
+                                      (double)numItems / seconds);
+  return res;
+}
+
+// Bounce a timestamp between two pinned threads through a pair of queues and
+// record every round trip, in nanoseconds
+template <typename Fifo>
+juce::var roundTripLatency(const juce::String &name, Fifo &ping, Fifo &pong,
+                           const Settings &settings) {
+  const auto numRoundTrips = settings.numRoundTrips;
+  std::vector<double> nanos;
+  nanos.reserve(numRoundTrips);
+
+  std::thread echo([&] {
+    pinToCore(1);
+    Payload<8> item;
+    for (size_t i = 0; i < numRoundTrips; ++i) {
+      while (!ping.pop(item))
+        backOff();
+      while (!pong.push(item))
+        backOff();
+    }
+  });
+
+  pinToCore(0);
+  Payload<8> item;
+  for (size_t i = 0; i < numRoundTrips; ++i) {
+    const auto start = Clock::now();
+    while (!ping.push(Payload<8>(i)))
+      backOff();
+    while (!pong.pop(item))
+      backOff();
+    nanos.push_back(
+        std::chrono::duration<double, std::nano>(Clock::now() - start)
+            .count());
+  }
+
+  echo.join();
+
+  auto res = result("roundTripNanos", name);
+  res.getDynamicObject()->setProperty("samples", (juce::int64)numRoundTrips);
+  res.getDynamicObject()->setProperty("percentiles", percentiles(nanos));
+  return res;
+}
+
+// Time from load() to the object turning up for the audio thread, for every
+// file in the samples directory. With a cache, every round after the first
+// is all hits
+template <typename LoaderType>
+juce::var loaderLatency(const juce::String &name, LoaderType &loader,
+                        const Settings &settings,
+                        std::shared_ptr<SampleCache> cache = nullptr) {
+  juce::AudioFormatManager formatManager;
+  formatManager.registerBasicFormats();
+
+  const auto files = juce::File(MUSIKHACK_SAMPLES_DIR)
+                         .findChildFiles(juce::File::findFiles, true,
+                                         "*.wav;*.aif");
+
+  std::vector<double> micros;
+  loader.startThread();
+
+  for (int round = 0; round < settings.numLoaderRounds; ++round) {
+    for (const auto &file : files) {
+      const auto start = Clock::now();
+      loader.load({file.getFileNameWithoutExtension(), file, &formatManager,
+                   0.0, cache});
+
+      typename LoaderType::ObjPtr sound;
+      while (!loader.getLoaded(sound))
+        backOff();
+
+      micros.push_back(
+          std::chrono::duration<double, std::micro>(Clock::now() - start)
+              .count());
+      loader.destroy(std::move(sound));
+    }
+  }
+
+  loader.stopThread(2000);
+
+  auto res = result("loadToAvailableMicros", name);
+  res.getDynamicObject()->setProperty("files", files.size());
+  res.getDynamicObject()->setProperty("samples", (juce::int64)micros.size());
+  res.getDynamicObject()->setProperty("percentiles", percentiles(micros));
+  return res;
+}
+
+// Time from loading every file in the samples directory at once to the last
+// object turning up, as when switching kits
+juce::var kitSwitchMillis(int numWorkers, const Settings &settings) {
+  juce::AudioFormatManager formatManager;
+  formatManager.registerBasicFormats();
+
+  const auto files = juce::File(MUSIKHACK_SAMPLES_DIR)
+                         .findChildFiles(juce::File::findFiles, true,
+                                         "*.wav;*.aif");
+
+  SoundLoader loader("BenchmarkKitLoader", (size_t)files.size(), false,
+                     numWorkers);
+  std::vector<double> millis;
+  loader.startThread();
+
+  for (int round = 0; round < settings.numLoaderRounds; ++round) {
+    const auto start = Clock::now();
+    for (const auto &file : files)
+      loader.load({file.getFileNameWithoutExtension(), file, &formatManager});
+
+    SoundLoader::ObjPtr sound;
+    for (int received = 0; received < files.size();) {
+      if (loader.getLoaded(sound)) {
+        ++received;
+        loader.destroy(std::move(sound));
+      } else {
+        backOff();
+      }
+    }
+
+    millis.push_back(
+        std::chrono::duration<double, std::milli>(Clock::now() - start)
+            .count());
+  }
+
+  loader.stopThread(2000);
+
+  auto res = result("kitSwitchMillis", "SoundLoader");
+  res.getDynamicObject()->setProperty("workers", numWorkers);
+  res.getDynamicObject()->setProperty("files", files.size());
+  res.getDynamicObject()->setProperty("percentiles", percentiles(millis));
+  return res;
+}
+
+//==============================================================================
+template <size_t Bytes>
+void queuePayloadSweep(juce::Array<juce::var> &results,
+                       const Settings &settings) {
+  for (const size_t capacity : {64, 1024, 16384}) {
+    Queue<Payload<Bytes>> queue(capacity);
+    results.add(singleItemThroughput<Queue<Payload<Bytes>>, Payload<Bytes>>(
+        "Queue", queue, capacity, settings));
+
+    MpscQueue<Payload<Bytes>> mpsc(capacity);
+    results.add(
+        singleItemThroughput<MpscQueue<Payload<Bytes>>, Payload<Bytes>>(
+            "MpscQueue", mpsc, capacity, settings));
+  }
+}
+
+void ringBlockSweep(juce::Array<juce::var> &results,
+                    const Settings &settings) {
+  for (const size_t capacity : {1024, 16384}) {
+    for (const size_t blockSize : {1, 64, 512}) {
+      Ring<float> ring(capacity);
+      results.add(bulkThroughput("Ring", ring, capacity, blockSize, settings));
+
+      Queue<float> queue(capacity);
+      results.add(
+          bulkThroughput("Queue", queue, capacity, blockSize, settings));
+    }
+  }
+
+  for (const size_t blockSize : {1, 64, 512}) {
+    auto ring = std::make_unique<StaticRing<float, 16384>>();
+    results.add(
+        bulkThroughput("StaticRing", *ring, 16384, blockSize, settings));
+  }
+}
+
+} // namespace
+
+//==============================================================================
+int main(int argc, char *argv[]) {
+  const juce::ArgumentList args(argc, argv);
+
+  Settings settings;
+  if (args.containsOption("--quick")) {
+    settings.numItems /= 10;
+    settings.numRoundTrips /= 10;
+    settings.numLoaderRounds = 1;
+  }
+
+  juce::Array<juce::var> results;
+
+  queuePayloadSweep<8>(results, settings);
+  queuePayloadSweep<64>(results, settings);
+  queuePayloadSweep<256>(results, settings);
+
+  ringBlockSweep(results, settings);
+
+  {
+    Queue<Payload<8>> ping(64), pong(64);
+    results.add(roundTripLatency("Queue", ping, pong, settings));
+  }
+  {
+    MpscQueue<Payload<8>> ping(64), pong(64);
+    results.add(roundTripLatency("MpscQueue", ping, pong, settings));
+  }
+
+  {
+    SoundLoader loader("BenchmarkLoader", 8);
+    results.add(loaderLatency("SoundLoader", loader, settings));
+  }
+  {
+    SoundLoader loader("BenchmarkCachedLoader", 8);
+    results.add(loaderLatency("SoundLoader+SampleCache", loader, settings,
+                              std::make_shared<SampleCache>()));
+  }
+
+  results.add(kitSwitchMillis(1, settings));
+  results.add(kitSwitchMillis(juce::SystemStats::getNumCpus(), settings));
+
+  auto *report = new juce::DynamicObject();
+  report->setProperty("cpus", juce::SystemStats::getNumCpus());
+  report->setProperty("results", results);
+  const auto json = juce::JSON::toString(juce::var(report));
+
+  const auto out = args.getValueForOption("--out");
+  if (out.isNotEmpty())
+    return juce::File::getCurrentWorkingDirectory()
+                   .getChildFile(out)
+                   .replaceWithText(json)
+               ? 0
+               : 1;
+
+  std::cout << json << std::endl;
+  return 0;
+}
@@ -8,7 +8,7 @@
       vendor:           Musik Hack LLC
       version:          1.0.0
       name:             lockfree
-      description:      helper functions for moodycamel single writer, single consumer lock-free queues
+      description:      lock-free queues, rings and background loaders for real-time audio
       license:          Apache 2
       dependencies:     juce_core
 
@@ -16,266 +16,4238 @@
 
 #endif
 
-#include "deps/readerwriterqueue/readerwritercircularbuffer.h"
 #include "deps/readerwriterqueue/readerwriterqueue.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <functional>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <new>
+#include <numeric>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 #include <juce_audio_formats/juce_audio_formats.h>
 #include <juce_core/juce_core.h>
 #include <juce_dsp/juce_dsp.h>
 
+#if !JUCE_WINDOWS
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 namespace musikhack {
 namespace lockfree {
 
-template <typename T> class Queue {
-public:
-  using CallBack = std::function<void(T &)>;
-  using TypedQueue = moodycamel::ReaderWriterQueue<T>;
+// What a Ring does when the producer finds it full
+enum class Overflow {
+  // the push fails and the new data is lost
+  discardNewest,
+
+  // the push always succeeds and the oldest data is dropped to make room
+  overwriteOldest
+};
+
+// A histogram with one bucket per power of two: bucket b counts values in
+// [2^b, 2^(b+1)), with 0 going in the first bucket and anything too big in
+// the last. One thread records while any other thread reads
+class Log2Histogram {
+public:
+  static constexpr int numBuckets = 40;
+
+  void record(juce::uint64 value) noexcept {
+    int bucket = 0;
+    while ((value >>= 1) != 0 && bucket < numBuckets - 1)
+      ++bucket;
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  juce::uint64 getCount(int bucket) const noexcept {
+    return buckets[bucket].load(std::memory_order_relaxed);
+  }
+
+  juce::uint64 getTotal() const noexcept {
+    juce::uint64 total = 0;
+    for (auto &b : buckets)
+      total += b.load(std::memory_order_relaxed);
+    return total;
+  }
+
+  // The upper bound of the bucket holding the given fraction (0 to 1) of
+  // everything recorded, e.g. 0.99 for the 99th percentile
+  juce::uint64 getPercentileUpperBound(double fraction) const noexcept {
+    const auto total = getTotal();
+    if (total == 0)
+      return 0;
+
+    const auto wanted = (juce::uint64)std::ceil(fraction * (double)total);
+    juce::uint64 seen = 0;
+    for (int b = 0; b < numBuckets; ++b) {
+      seen += getCount(b);
+      if (seen >= wanted)
+        return ((juce::uint64)2 << b) - 1;
+    }
+    return std::numeric_limits<juce::uint64>::max();
+  }
+
+  void reset() noexcept {
+    for (auto &b : buckets)
+      b.store(0, std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<juce::uint64> buckets[numBuckets]{};
+};
+
+// The default instrumentation policy for the queues. Every hook is empty
+// and the queues skip computing its arguments, so it costs nothing
+struct NoStats {
+  static constexpr bool enabled = false;
+
+  void allocate(size_t) noexcept {}
+  void pushed(size_t, size_t, size_t) noexcept {}
+  void rejected(size_t) noexcept {}
+  void popped(size_t, size_t) noexcept {}
+};
+
+// An instrumentation policy that counts failed pushes, remembers the deepest
+// the queue has been and records how long each item waited in the queue, in
+// nanoseconds. The queue threads only touch atomics and a timestamp per slot;
+// the getters are safe to call from any other thread.
+class QueueStats {
+public:
+  static constexpr bool enabled = true;
+
+  QueueStats() = default;
+
+  // Items that didn't fit. For Overflow::overwriteOldest rings, see
+  // takeNumDropped() instead
+  size_t getNumRejected() const noexcept {
+    return numRejected.load(std::memory_order_relaxed);
+  }
+
+  // The most items that were in the queue at once
+  size_t getMaxDepth() const noexcept {
+    return maxDepth.load(std::memory_order_relaxed);
+  }
+
+  // Time from push to pop per item, in nanoseconds
+  const Log2Histogram &getResidenceTimes() const noexcept {
+    return residence;
+  }
+
+  void reset() noexcept {
+    numRejected.store(0, std::memory_order_relaxed);
+    maxDepth.store(0, std::memory_order_relaxed);
+    residence.reset();
+  }
+
+  //==== hooks called by the queues
+
+  // Not thread safe!
+  void allocate(size_t capacity) {
+    stamps.reset(new std::atomic<juce::int64>[capacity]);
+    mask = capacity - 1;
+  }
+
+  // count items went in at position, leaving depth items in the queue.
+  // Called before they are published
+  void pushed(size_t position, size_t count, size_t depth) noexcept {
+    const auto now = juce::Time::getHighResolutionTicks();
+    for (size_t i = 0; i < count; ++i)
+      stamps[(position + i) & mask].store(now, std::memory_order_relaxed);
+
+    auto deepest = maxDepth.load(std::memory_order_relaxed);
+    while (depth > deepest &&
+           !maxDepth.compare_exchange_weak(deepest, depth,
+                                           std::memory_order_relaxed)) {
+    }
+  }
+
+  void rejected(size_t count) noexcept {
+    numRejected.fetch_add(count, std::memory_order_relaxed);
+  }
+
+  // count items came out from position. Called before their slots are
+  // handed back
+  void popped(size_t position, size_t count) noexcept {
+    const auto now = juce::Time::getHighResolutionTicks();
+    for (size_t i = 0; i < count; ++i) {
+      const auto ticks =
+          now - stamps[(position + i) & mask].load(std::memory_order_relaxed);
+      residence.record((juce::uint64)((double)juce::jmax<juce::int64>(0, ticks) *
+                                      nanosPerTick));
+    }
+  }
+
+private:
+  const double nanosPerTick =
+      1.0e9 / (double)juce::Time::getHighResolutionTicksPerSecond();
+
+  std::atomic<size_t> numRejected{0};
+  std::atomic<size_t> maxDepth{0};
+  Log2Histogram residence;
+  std::unique_ptr<std::atomic<juce::int64>[]> stamps;
+  size_t mask = 0;
+};
+
+namespace detail {
+
+// Round up to a power of two so ring indices can be masked rather than wrapped
+// with a modulo
+constexpr size_t nextPowerOfTwo(size_t v) {
+  size_t p = 1;
+  while (p < v)
+    p <<= 1;
+  return p;
+}
+
+// Keeps the producer's and consumer's halves of a FIFO on separate cache
+// lines so the two threads don't keep stealing the line from each other
+static constexpr size_t cacheLineSize = 64;
+
+// Raw slots for a FIFO, allocated on the heap with a capacity picked at
+// runtime and rounded up to a power of two
+template <typename T> class HeapStorage {
+  struct alignas(T) Slot {
+    unsigned char bytes[sizeof(T)];
+  };
+
+public:
+  explicit HeapStorage(size_t minCapacity) { allocate(minCapacity); }
+
+  void allocate(size_t minCapacity) {
+    const auto capacity = nextPowerOfTwo(std::max<size_t>(minCapacity, 1));
+    slots.reset(new Slot[capacity]);
+    mask = capacity - 1;
+  }
+
+  size_t getMask() const noexcept { return mask; }
+  void *get(size_t index) noexcept { return &slots[index & mask]; }
+
+private:
+  std::unique_ptr<Slot[]> slots;
+  size_t mask = 0;
+};
+
+// Raw slots for a FIFO, stored inline with a compile time power of two
+// capacity, so masking folds down to a constant
+template <typename T, size_t N> class InlineStorage {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of two");
+
+  struct alignas(T) Slot {
+    unsigned char bytes[sizeof(T)];
+  };
+
+public:
+  explicit InlineStorage(size_t = N) {}
+
+  static constexpr size_t getMask() noexcept { return N - 1; }
+  void *get(size_t index) noexcept { return &slots[index & (N - 1)]; }
+
+private:
+  Slot slots[N];
+};
+
+// Whether Word can tile T's bytes through std::atomic<Word> without locks
+template <typename T, typename Word>
+constexpr bool tilesWith = sizeof(T) % sizeof(Word) == 0 &&
+                           alignof(T) >= alignof(std::atomic<Word>) &&
+                           sizeof(std::atomic<Word>) == sizeof(Word) &&
+                           std::atomic<Word>::is_always_lock_free;
+
+// The widest word that does, for copying T a word at a time
+template <typename T>
+using CopyWord = std::conditional_t<
+    tilesWith<T, std::uint64_t>, std::uint64_t,
+    std::conditional_t<
+        tilesWith<T, std::uint32_t>, std::uint32_t,
+        std::conditional_t<tilesWith<T, std::uint16_t>, std::uint16_t,
+                           std::uint8_t>>>;
+
+// A bounded single producer, single consumer FIFO. Items are constructed in
+// place when pushed and destroyed when popped, so slots never hold a live T
+// that nobody can see. Both indices only ever grow; the number of ready items
+// is always write - read, and the slot is found by masking.
+//
+// Each side keeps a cached copy of the other side's index on its own cache
+// line and only reloads the shared one when the cached value says the FIFO
+// is full (or empty).
+//
+// With Overflow::overwriteOldest the producer pushes the read index forward
+// itself when it runs out of room, so the consumer claims items with a CAS
+// after copying them out and retries if the producer got there first. The
+// producer may be writing a slot while the consumer copies it, so both sides
+// copy a word at a time through relaxed atomics laid over the slots: a lapped
+// consumer reads a torn item and throws it away, but there's no data race.
+// That only works for trivially copyable items, and items can't be looked at
+// or filled in place.
+template <typename T, typename Storage = HeapStorage<T>,
+          Overflow policy = Overflow::discardNewest, typename Stats = NoStats>
+class SpscFifo {
+  static constexpr bool overwrites = policy == Overflow::overwriteOldest;
+  static_assert(!overwrites || std::is_trivially_copyable_v<T>,
+                "overwriteOldest needs a trivially copyable T");
+
+  using Word = CopyWord<T>;
+  static constexpr size_t wordsPerItem = sizeof(T) / sizeof(Word);
+
+public:
+  explicit SpscFifo(size_t minCapacity = 0) : storage(minCapacity) {
+    stats.allocate(getCapacity());
+    startWords();
+  }
+  ~SpscFifo() { clear(); }
+
+  SpscFifo(const SpscFifo &) = delete;
+  SpscFifo &operator=(const SpscFifo &) = delete;
+
+  size_t getCapacity() const noexcept { return storage.getMask() + 1; }
+
+  // Number of items ready to read. Exact from either end of the queue, but
+  // only a snapshot from any other thread
+  size_t getNumReady() const noexcept {
+    return producer.index.load(std::memory_order_acquire) -
+           consumer.index.load(std::memory_order_acquire);
+  }
+
+  // How many items the producer has overwritten since the last call. Only
+  // ever non-zero with Overflow::overwriteOldest
+  size_t takeNumDropped() noexcept {
+    return dropped.exchange(0, std::memory_order_relaxed);
+  }
+
+  Stats &getStats() noexcept { return stats; }
+  const Stats &getStats() const noexcept { return stats; }
+
+  //==== producer side
+
+  template <typename... Args> bool emplace(Args &&...args) {
+    jassert(!producer.reserved);
+    const auto w = producer.index.load(std::memory_order_relaxed);
+    if (claim(w, 1) == 0) {
+      noteRejected(1);
+      return false;
+    }
+
+    if constexpr (overwrites) {
+      const T made(std::forward<Args>(args)...);
+      copyIn(w, &made, 1);
+    } else {
+      ::new (storage.get(w)) T(std::forward<Args>(args)...);
+    }
+    notePushed(w, 1);
+    producer.index.store(w + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Copy as many of items as will fit and publish them with a single store.
+  // When overwriting, everything fits, though only the last getCapacity()
+  // items survive. Returns the number of items written
+  size_t write(const T *items, size_t count) {
+    jassert(!producer.reserved);
+    const auto w = producer.index.load(std::memory_order_relaxed);
+
+    if constexpr (overwrites) {
+      if (count > getCapacity()) {
+        const auto skipped = count - getCapacity();
+        dropped.fetch_add(skipped, std::memory_order_relaxed);
+        items += skipped;
+        count -= skipped;
+      }
+    }
+
+    const auto wanted = count;
+    count = std::min(count, claim(w, count));
+    if (count < wanted)
+      noteRejected(wanted - count);
+    if (count == 0)
+      return 0;
+
+    copyIn(w, items, count);
+    notePushed(w, count);
+    producer.index.store(w + count, std::memory_order_release);
+    return count;
+  }
+
+  // Default construct an item in the next free slot without publishing it,
+  // so it can be filled in place. Returns nullptr if the FIFO is full.
+  // Calling it again before commit() hands back the same item
+  T *reserve() {
+    static_assert(std::is_default_constructible_v<T>,
+                  "reserve() needs a default constructible T");
+    static_assert(!overwrites, "Items can't be filled in place when the "
+                               "consumer may be copying the slot, use push()");
+
+    const auto w = producer.index.load(std::memory_order_relaxed);
+    if (!producer.reserved) {
+      if (claim(w, 1) == 0) {
+        noteRejected(1);
+        return nullptr;
+      }
+
+      ::new (storage.get(w)) T;
+      producer.reserved = true;
+    }
+    return item(w);
+  }
+
+  // Publish the item handed out by reserve()
+  void commit() noexcept {
+    jassert(producer.reserved);
+    producer.reserved = false;
+    const auto w = producer.index.load(std::memory_order_relaxed);
+    notePushed(w, 1);
+    producer.index.store(w + 1, std::memory_order_release);
+  }
+
+  //==== consumer side
+
+  // The oldest item in the queue, or nullptr if it is empty
+  T *front() noexcept {
+    static_assert(!overwrites, "Items can't be read in place when the "
+                               "producer may overwrite them, use pop()");
+    const auto r = consumer.index.load(std::memory_order_relaxed);
+    if (getNumReadable(r) == 0)
+      return nullptr;
+    return item(r);
+  }
+
+  // Destroy the item returned by front() and hand its slot back
+  void popFront() noexcept {
+    static_assert(!overwrites, "Items can't be read in place when the "
+                               "producer may overwrite them, use pop()");
+    const auto r = consumer.index.load(std::memory_order_relaxed);
+    item(r)->~T();
+    notePopped(r, 1);
+    consumer.index.store(r + 1, std::memory_order_release);
+  }
+
+  bool pop(T &out) { return read(&out, 1) == 1; }
+
+  // Move up to maxCount items into dest and release their slots with a single
+  // store. Returns the number of items read
+  size_t read(T *dest, size_t maxCount) {
+    if constexpr (overwrites) {
+      for (;;) {
+        auto r = consumer.index.load(std::memory_order_acquire);
+        const auto count = std::min(maxCount, getNumReadable(r, maxCount));
+        if (count == 0)
+          return 0;
+
+        // The copy may be torn if the producer laps us mid-way, but then it
+        // has already moved the read index and the CAS tells us to retry.
+        // Each word is read atomically, so tearing is the worst of it
+        copyOut(r, dest, count);
+        if (consumer.index.compare_exchange_strong(r, r + count,
+                                                   std::memory_order_acq_rel)) {
+          notePopped(r, count);
+          return count;
+        }
+      }
+    } else {
+      const auto r = consumer.index.load(std::memory_order_relaxed);
+      const auto count = std::min(maxCount, getNumReadable(r, maxCount));
+      if (count == 0)
+        return 0;
+
+      copyOut(r, dest, count);
+      notePopped(r, count);
+      consumer.index.store(r + count, std::memory_order_release);
+      return count;
+    }
+  }
+
+  // Pop every item and run fn on each
+  template <typename Fn> void consumeAll(Fn &&fn) {
+    if constexpr (overwrites) {
+      T out{};
+      while (pop(out))
+        fn(out);
+    } else {
+      while (auto *next = front()) {
+        fn(*next);
+        popFront();
+      }
+    }
+  }
+
+  // Pop every item, but only run fn on the last one
+  template <typename Fn> void consumeLast(Fn &&fn) {
+    if constexpr (overwrites) {
+      T out{};
+      bool ran = false;
+      while (pop(out))
+        ran = true;
+      if (ran)
+        fn(out);
+    } else {
+      auto *next = front();
+      if (next == nullptr)
+        return;
+
+      while (getNumReady() > 1) {
+        popFront();
+        next = front();
+      }
+
+      fn(*next);
+      popFront();
+    }
+  }
+
+  //==== neither side, not thread safe!
+
+  // Destroy every item still in the FIFO
+  void clear() noexcept {
+    const auto w = producer.index.load(std::memory_order_acquire);
+    if constexpr (!std::is_trivially_destructible_v<T>) {
+      for (auto r = consumer.index.load(std::memory_order_relaxed); r != w;
+           ++r)
+        item(r)->~T();
+      if (producer.reserved)
+        item(w)->~T();
+    }
+    producer.reserved = false;
+    producer.index.store(0, std::memory_order_relaxed);
+    producer.cachedOther = 0;
+    consumer.index.store(0, std::memory_order_relaxed);
+    consumer.cachedOther = 0;
+    dropped.store(0, std::memory_order_relaxed);
+  }
+
+  // Destroy everything and reallocate. Only for heap storage
+  void reset(size_t minCapacity) {
+    clear();
+    storage.allocate(minCapacity);
+    stats.allocate(getCapacity());
+    startWords();
+  }
+
+private:
+  struct alignas(cacheLineSize) Side {
+    std::atomic<size_t> index{0};
+    size_t cachedOther = 0;
+    bool reserved = false;
+  };
+
+  // Space for at least wanted more items, reloading the consumer's index
+  // only when the cached copy can't promise it
+  size_t getFreeSpace(size_t w, size_t wanted = 1) noexcept {
+    auto space = getCapacity() - (w - producer.cachedOther);
+    if (space < wanted) {
+      producer.cachedOther = consumer.index.load(std::memory_order_acquire);
+      space = getCapacity() - (w - producer.cachedOther);
+    }
+    return space;
+  }
+
+  // The free space for count items (no more than the capacity). When
+  // overwriting, the oldest items are dropped until there is enough
+  size_t claim(size_t w, size_t count) noexcept {
+    const auto space = getFreeSpace(w, count);
+    if constexpr (overwrites) {
+      if (space < count) {
+        dropOldest(w + count - getCapacity());
+        return count;
+      }
+    }
+    return space;
+  }
+
+  // The instrumentation hooks. Depth costs an extra load of the consumer's
+  // index, so it's only worked out when Stats wants it
+  void notePushed(size_t w, size_t count) noexcept {
+    if constexpr (Stats::enabled)
+      stats.pushed(w, count,
+                   w + count - consumer.index.load(std::memory_order_relaxed));
+  }
+  void noteRejected(size_t count) noexcept { stats.rejected(count); }
+  void notePopped(size_t r, size_t count) noexcept { stats.popped(r, count); }
+
+  // Move the read index up to newRead unless the consumer already has
+  void dropOldest(size_t newRead) noexcept {
+    auto r = consumer.index.load(std::memory_order_acquire);
+    while (r < newRead &&
+           !consumer.index.compare_exchange_weak(r, newRead,
+                                                 std::memory_order_acq_rel)) {
+    }
+
+    if (r < newRead)
+      dropped.fetch_add(newRead - r, std::memory_order_relaxed);
+    producer.cachedOther = newRead;
+  }
+
+  size_t getNumReadable(size_t r, size_t wanted = 1) noexcept {
+    auto ready = consumer.cachedOther - r;
+    if (ready < wanted || ready > getCapacity()) {
+      consumer.cachedOther = producer.index.load(std::memory_order_acquire);
+      ready = consumer.cachedOther - r;
+    }
+    return ready;
+  }
+
+  T *item(size_t index) noexcept {
+    return std::launder(reinterpret_cast<T *>(storage.get(index)));
+  }
+
+  // When overwriting, the slots only ever hold the atomic words, which live
+  // as long as the storage
+  void startWords() noexcept {
+    if constexpr (overwrites) {
+      for (size_t i = 0; i < getCapacity(); ++i)
+        for (size_t k = 0; k < wordsPerItem; ++k)
+          ::new (getWordAddress(i, k)) std::atomic<Word>(0);
+    }
+  }
+
+  void *getWordAddress(size_t index, size_t k) noexcept {
+    return static_cast<unsigned char *>(storage.get(index)) + k * sizeof(Word);
+  }
+
+  std::atomic<Word> &word(size_t index, size_t k) noexcept {
+    return *std::launder(
+        reinterpret_cast<std::atomic<Word> *>(getWordAddress(index, k)));
+  }
+
+  // A run of count items starting at index wraps at most once, so trivially
+  // copyable items move in at most two memcpys. Overwritten ones go a word at
+  // a time, which is as cheap as a plain copy on the usual platforms
+  void copyIn(size_t index, const T *items, size_t count) {
+    if constexpr (overwrites) {
+      const auto *bytes = reinterpret_cast<const unsigned char *>(items);
+      for (size_t i = 0; i < count; ++i) {
+        for (size_t k = 0; k < wordsPerItem; ++k, bytes += sizeof(Word)) {
+          Word w;
+          std::memcpy(&w, bytes, sizeof(Word));
+          word(index + i, k).store(w, std::memory_order_relaxed);
+        }
+      }
+    } else if constexpr (std::is_trivially_copyable_v<T>) {
+      const auto first =
+          std::min(count, getCapacity() - (index & storage.getMask()));
+      std::memcpy(storage.get(index), items, first * sizeof(T));
+      std::memcpy(storage.get(index + first), items + first,
+                  (count - first) * sizeof(T));
+    } else {
+      for (size_t i = 0; i < count; ++i)
+        ::new (storage.get(index + i)) T(items[i]);
+    }
+  }
+
+  void copyOut(size_t index, T *dest, size_t count) {
+    if constexpr (overwrites) {
+      auto *bytes = reinterpret_cast<unsigned char *>(dest);
+      for (size_t i = 0; i < count; ++i) {
+        for (size_t k = 0; k < wordsPerItem; ++k, bytes += sizeof(Word)) {
+          const auto w = word(index + i, k).load(std::memory_order_relaxed);
+          std::memcpy(bytes, &w, sizeof(Word));
+        }
+      }
+    } else if constexpr (std::is_trivially_copyable_v<T>) {
+      const auto first =
+          std::min(count, getCapacity() - (index & storage.getMask()));
+      std::memcpy(dest, storage.get(index), first * sizeof(T));
+      std::memcpy(dest + first, storage.get(index + first),
+                  (count - first) * sizeof(T));
+    } else {
+      for (size_t i = 0; i < count; ++i) {
+        dest[i] = std::move(*item(index + i));
+        item(index + i)->~T();
+      }
+    }
+  }
+
+  Side producer;
+  Side consumer;
+  std::atomic<size_t> dropped{0};
+  Stats stats;
+  Storage storage;
+};
+
+// A bounded multiple producer, single consumer FIFO, after Dmitry Vyukov's
+// bounded queue. Every cell carries a sequence number telling producers
+// whether it's free for their lap and telling the consumer whether its item
+// has been published. Producers claim a position with a CAS on the enqueue
+// index and never wait on each other or on a lock; a producer that is
+// preempted mid-push only holds back the consumer, which sees an empty
+// queue until the item is published.
+template <typename T, typename Stats = NoStats> class MpscFifo {
+  struct Cell {
+    std::atomic<size_t> sequence;
+    alignas(T) unsigned char bytes[sizeof(T)];
+  };
+
+public:
+  explicit MpscFifo(size_t minCapacity) { allocate(minCapacity); }
+  ~MpscFifo() { clear(); }
+
+  MpscFifo(const MpscFifo &) = delete;
+  MpscFifo &operator=(const MpscFifo &) = delete;
+
+  size_t getCapacity() const noexcept { return mask + 1; }
+
+  Stats &getStats() noexcept { return stats; }
+  const Stats &getStats() const noexcept { return stats; }
+
+  // A snapshot of the number of claimed positions, including any that are
+  // still being written
+  size_t getNumReady() const noexcept {
+    return enqueuePos.load(std::memory_order_acquire) -
+           dequeuePos.load(std::memory_order_acquire);
+  }
+
+  //==== producer side, any thread
+
+  template <typename... Args> bool emplace(Args &&...args) {
+    auto pos = enqueuePos.load(std::memory_order_relaxed);
+    Cell *cell;
+
+    for (;;) {
+      cell = &cells[pos & mask];
+      const auto seq = cell->sequence.load(std::memory_order_acquire);
+      const auto diff = (std::ptrdiff_t)seq - (std::ptrdiff_t)pos;
+
+      if (diff == 0) {
+        if (enqueuePos.compare_exchange_weak(pos, pos + 1,
+                                             std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        // the consumer hasn't freed this cell from the previous lap
+        stats.rejected(1);
+        return false;
+      } else {
+        pos = enqueuePos.load(std::memory_order_relaxed);
+      }
+    }
+
+    ::new (cell->bytes) T(std::forward<Args>(args)...);
+    if constexpr (Stats::enabled)
+      stats.pushed(pos, 1,
+                   pos + 1 - dequeuePos.load(std::memory_order_relaxed));
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  //==== consumer side
+
+  // The oldest published item, or nullptr if there isn't one yet
+  T *front() noexcept {
+    const auto pos = dequeuePos.load(std::memory_order_relaxed);
+    auto &cell = cells[pos & mask];
+    if (cell.sequence.load(std::memory_order_acquire) != pos + 1)
+      return nullptr;
+    return item(cell);
+  }
+
+  // Whether another published item is waiting behind front()
+  bool hasNext() const noexcept {
+    const auto pos = dequeuePos.load(std::memory_order_relaxed) + 1;
+    return cells[pos & mask].sequence.load(std::memory_order_acquire) ==
+           pos + 1;
+  }
+
+  // Destroy the item returned by front() and hand its cell to the next lap
+  void popFront() noexcept {
+    const auto pos = dequeuePos.load(std::memory_order_relaxed);
+    auto &cell = cells[pos & mask];
+    item(cell)->~T();
+    stats.popped(pos, 1);
+    cell.sequence.store(pos + mask + 1, std::memory_order_release);
+    dequeuePos.store(pos + 1, std::memory_order_release);
+  }
+
+  bool pop(T &out) {
+    auto *next = front();
+    if (next == nullptr)
+      return false;
+
+    out = std::move(*next);
+    popFront();
+    return true;
+  }
+
+  //==== neither side, not thread safe!
+
+  void clear() noexcept {
+    while (front() != nullptr)
+      popFront();
+  }
+
+  void reset(size_t minCapacity) {
+    clear();
+    allocate(minCapacity);
+  }
+
+private:
+  void allocate(size_t minCapacity) {
+    const auto capacity = nextPowerOfTwo(std::max<size_t>(minCapacity, 2));
+    cells.reset(new Cell[capacity]);
+    mask = capacity - 1;
+    for (size_t i = 0; i < capacity; ++i)
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+    enqueuePos.store(0, std::memory_order_relaxed);
+    dequeuePos.store(0, std::memory_order_relaxed);
+    stats.allocate(capacity);
+  }
+
+  static T *item(Cell &cell) noexcept {
+    return std::launder(reinterpret_cast<T *>(cell.bytes));
+  }
+
+  std::unique_ptr<Cell[]> cells;
+  size_t mask = 0;
+  Stats stats;
+  alignas(cacheLineSize) std::atomic<size_t> enqueuePos{0};
+  alignas(cacheLineSize) std::atomic<size_t> dequeuePos{0};
+};
+
+// A bounded Chase-Lev work-stealing deque, after Le, Pop, Cohen and Zappa
+// Nardelli's C11 version. One owner thread pushes and pops at the bottom,
+// any number of thieves take from the top, and only the last item is ever
+// contended. T is read before the CAS that claims it, so it has to be
+// trivially copyable; in practice it's a pointer to the real work.
+template <typename T> class WorkStealingDeque {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "WorkStealingDeque holds pointers or small handles");
+
+public:
+  explicit WorkStealingDeque(size_t minCapacity)
+      : mask(nextPowerOfTwo(std::max<size_t>(minCapacity, 2)) - 1),
+        cells(new std::atomic<T>[mask + 1]) {}
+
+  WorkStealingDeque(const WorkStealingDeque &) = delete;
+  WorkStealingDeque &operator=(const WorkStealingDeque &) = delete;
+
+  //==== owner side
+
+  // Returns false without taking the item when the deque is full
+  bool push(T item) noexcept {
+    const auto b = bottom.load(std::memory_order_relaxed);
+    const auto t = top.load(std::memory_order_acquire);
+    if (b - t > (std::int64_t)mask)
+      return false;
+
+    // a release store rather than the paper's release fence; it's the same
+    // ordering and sanitizers can follow it
+    cells[(size_t)b & mask].store(item, std::memory_order_relaxed);
+    bottom.store(b + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Take the newest item, or return false if the thieves got there first
+  bool pop(T &out) noexcept {
+    const auto b = bottom.load(std::memory_order_relaxed) - 1;
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto t = top.load(std::memory_order_relaxed);
+
+    if (t > b) {
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return false;
+    }
+
+    out = cells[(size_t)b & mask].load(std::memory_order_relaxed);
+    if (t == b) {
+      // the last item, so race the thieves for it
+      const auto won = top.compare_exchange_strong(
+          t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return won;
+    }
+    return true;
+  }
+
+  //==== thief side, any thread
+
+  // Take the oldest item. Only returns false once the deque is empty; a lost
+  // race means someone else made progress, so it tries again
+  bool steal(T &out) noexcept {
+    for (;;) {
+      auto t = top.load(std::memory_order_acquire);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      const auto b = bottom.load(std::memory_order_acquire);
+      if (t >= b)
+        return false;
+
+      out = cells[(size_t)t & mask].load(std::memory_order_relaxed);
+      if (top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed))
+        return true;
+    }
+  }
+
+private:
+  const size_t mask;
+  std::unique_ptr<std::atomic<T>[]> cells;
+  alignas(cacheLineSize) std::atomic<std::int64_t> top{0};
+  alignas(cacheLineSize) std::atomic<std::int64_t> bottom{0};
+};
+
+} // namespace detail
+
+// A type erased callable like std::function, except that the callable is
+// always stored inside the object. Anything bigger than Capacity bytes fails to
+// compile rather than going to the heap, so it's safe to create, copy and call
+// on the audio thread.
+template <typename Signature, size_t Capacity = 32> class InplaceFunction;
+
+template <typename R, typename... Args, size_t Capacity>
+class InplaceFunction<R(Args...), Capacity> {
+public:
+  InplaceFunction() noexcept = default;
+  InplaceFunction(std::nullptr_t) noexcept {}
+
+  template <typename Fn,
+            typename = std::enable_if_t<
+                !std::is_same_v<std::decay_t<Fn>, InplaceFunction>>>
+  InplaceFunction(Fn &&fn) {
+    using Stored = std::decay_t<Fn>;
+    static_assert(sizeof(Stored) <= Capacity,
+                  "Callable is too big for this InplaceFunction, capture less "
+                  "or raise the capacity");
+    static_assert(alignof(Stored) <= alignof(std::max_align_t),
+                  "Callable is over-aligned");
+    static_assert(std::is_copy_constructible_v<Stored>,
+                  "Callable must be copy constructible");
+
+    ::new (storage) Stored(std::forward<Fn>(fn));
+    ops = &opsFor<Stored>;
+  }
+
+  InplaceFunction(const InplaceFunction &other) : ops(other.ops) {
+    if (ops != nullptr)
+      ops->copy(other.storage, storage);
+  }
+
+  InplaceFunction(InplaceFunction &&other) noexcept : ops(other.ops) {
+    if (ops != nullptr)
+      ops->move(other.storage, storage);
+    other.ops = nullptr;
+  }
+
+  InplaceFunction &operator=(const InplaceFunction &other) {
+    if (this != &other) {
+      reset();
+      if (other.ops != nullptr)
+        other.ops->copy(other.storage, storage);
+      ops = other.ops;
+    }
+    return *this;
+  }
+
+  InplaceFunction &operator=(InplaceFunction &&other) noexcept {
+    if (this != &other) {
+      reset();
+      if (other.ops != nullptr)
+        other.ops->move(other.storage, storage);
+      ops = std::exchange(other.ops, nullptr);
+    }
+    return *this;
+  }
+
+  ~InplaceFunction() { reset(); }
+
+  R operator()(Args... args) const {
+    jassert(ops != nullptr);
+    return ops->invoke(storage, std::forward<Args>(args)...);
+  }
+
+  explicit operator bool() const noexcept { return ops != nullptr; }
+
+  void reset() noexcept {
+    if (ops != nullptr)
+      ops->destroy(storage);
+    ops = nullptr;
+  }
+
+private:
+  struct Ops {
+    R (*invoke)(void *, Args &&...);
+    void (*copy)(const void *, void *);
+    void (*move)(void *, void *) noexcept;
+    void (*destroy)(void *) noexcept;
+  };
+
+  template <typename Stored>
+  static constexpr Ops opsFor = {
+      [](void *s, Args &&...args) -> R {
+        return (*static_cast<Stored *>(s))(std::forward<Args>(args)...);
+      },
+      [](const void *from, void *to) {
+        ::new (to) Stored(*static_cast<const Stored *>(from));
+      },
+      [](void *from, void *to) noexcept {
+        ::new (to) Stored(std::move(*static_cast<Stored *>(from)));
+        static_cast<Stored *>(from)->~Stored();
+      },
+      [](void *s) noexcept { static_cast<Stored *>(s)->~Stored(); }};
+
+  alignas(std::max_align_t) mutable unsigned char storage[Capacity];
+  const Ops *ops = nullptr;
+};
+
+// A single producer, single consumer queue of messages. Pass QueueStats as
+// Stats to instrument it.
+template <typename T, typename Stats = NoStats> class Queue {
+public:
+  using CallBack = InplaceFunction<void(T &)>;
+  using TypedQueue = detail::SpscFifo<T, detail::HeapStorage<T>,
+                                      Overflow::discardNewest, Stats>;
+
+  Queue(size_t s = 1024) : size(s), queue(s) {}
+
+  size_t getSize() const noexcept { return size; }
+
+  // Resize the queue, but deletes all existing data.
+  // Not thread safe!
+  void resize(int s) {
+    size = s;
+    queue.reset(size);
+  }
+
+  // Wipes out the queue and resets it to its initial state
+  // Not thread safe!
+  void clear() { queue.reset(size); }
+
+  // push an item into the queue
+  bool push(T const &item) { return queue.emplace(item); }
+
+  // push an item into the queue using move semantics
+  bool push(T &&item) { return queue.emplace(std::move(item)); }
+
+  // push an item into the queue using emplace semantics
+  template <typename... Args> bool emplace(Args &&...args) {
+    return queue.emplace(std::forward<Args>(args)...);
+  }
+
+  // push a block of items into the queue, publishing them all at once.
+  // Returns how many of them fit
+  size_t pushN(T const *items, size_t count) {
+    return queue.write(items, count);
+  }
+
+  // pop from the queue into item
+  bool pop(T &item) { return queue.pop(item); }
+
+  // pop up to maxCount items into dest at once. Returns how many were popped
+  size_t popN(T *dest, size_t maxCount) { return queue.read(dest, maxCount); }
+
+  // get a default constructed item in the next free slot to fill in place,
+  // or nullptr if full. Nothing is visible to the reader until commit()
+  T *reserve() { return queue.reserve(); }
+
+  // publish the item from reserve()
+  void commit() noexcept { queue.commit(); }
+
+  // look at the oldest item in place without popping it, or nullptr if empty
+  T *peek() noexcept { return queue.front(); }
+
+  // pop the item returned by peek()
+  void release() noexcept { queue.popFront(); }
+
+  // pop each item out of the queue and run a callback on it. The callback
+  // can be any callable taking a T &, and it sees the item in place
+  template <typename Fn> void forEach(Fn &&cbk) { queue.consumeAll(cbk); }
+
+  // pop each item out of the queue, but only run the callback on the last one
+  template <typename Fn> void forLast(Fn &&cbk) { queue.consumeLast(cbk); }
+
+  // the instrumentation, when Stats is QueueStats. Safe to read from any
+  // thread
+  const Stats &getStats() const noexcept { return queue.getStats(); }
+
+  // return a reference to the underlying queue
+  TypedQueue &getQueue() noexcept { return queue; }
+
+private:
+  size_t size;
+  TypedQueue queue;
+};
+
+// A ring of samples (or anything else) between two threads. With
+// Overflow::overwriteOldest the producer never fails: when the consumer falls
+// behind, the oldest items are dropped and the consumer can find out how many
+// with takeNumDropped(). peek() and release() aren't available in that mode.
+template <typename T, Overflow policy = Overflow::discardNewest,
+          typename Stats = NoStats>
+class Ring {
+public:
+  using CallBack = InplaceFunction<void(T &)>;
+  using TypedQueue =
+      detail::SpscFifo<T, detail::HeapStorage<T>, policy, Stats>;
+
+  Ring(size_t s = 1024) : size(s), queue(s) {}
+
+  // Resize the queue, but deletes all existing data.
+  // Not thread safe!
+  void resize(int s) {
+    size = s;
+    queue.reset(size);
+  }
+
+  size_t getSize() const noexcept { return size; }
+
+  // Wipes out the queue and resets it to its initial state
+  // Not thread safe!
+  void clear() { queue.reset(size); }
+
+  // push an item into the queue
+  bool push(T const &item) { return queue.emplace(item); }
+
+  // push an item into the queue using move semantics
+  bool push(T &&item) { return queue.emplace(std::move(item)); }
+
+  // push an item into the queue using emplace semantics
+  template <typename... Args> bool emplace(Args &&...args) {
+    return queue.emplace(std::forward<Args>(args)...);
+  }
+
+  // push a block of items into the ring, publishing them all at once. For
+  // trivially copyable types this is at most two memcpys.
+  // Returns how many of them fit
+  size_t pushN(T const *items, size_t count) {
+    return queue.write(items, count);
+  }
+
+  // pop from the queue into item
+  bool pop(T &item) { return queue.pop(item); }
+
+  // pop up to maxCount items into dest at once. Returns how many were popped
+  size_t popN(T *dest, size_t maxCount) { return queue.read(dest, maxCount); }
+
+  // get a default constructed item in the next free slot to fill in place,
+  // or nullptr if full. Nothing is visible to the reader until commit()
+  T *reserve() { return queue.reserve(); }
+
+  // publish the item from reserve()
+  void commit() noexcept { queue.commit(); }
+
+  // look at the oldest item in place without popping it, or nullptr if empty
+  T *peek() noexcept { return queue.front(); }
+
+  // pop the item returned by peek()
+  void release() noexcept { queue.popFront(); }
+
+  // pop each item out of the queue and run a callback on it. The callback
+  // can be any callable taking a T &, and it sees the item in place
+  template <typename Fn> void forEach(Fn &&cbk) { queue.consumeAll(cbk); }
+
+  // pop each item out of the queue, but only run the callback on the last one
+  template <typename Fn> void forLast(Fn &&cbk) { queue.consumeLast(cbk); }
+
+  // how many items were overwritten since the last call, when the ring uses
+  // Overflow::overwriteOldest. Call from the consumer
+  size_t takeNumDropped() noexcept { return queue.takeNumDropped(); }
+
+  // the instrumentation, when Stats is QueueStats. Safe to read from any
+  // thread
+  const Stats &getStats() const noexcept { return queue.getStats(); }
+
+  // return a reference to the underlying queue
+  TypedQueue &getQueue() noexcept { return queue; }
+
+private:
+  size_t size;
+  TypedQueue queue;
+};
+
+// A Ring whose capacity is fixed at compile time. N must be a power of two.
+// The slots live inside the object, so there's no allocation at all, and the
+// producer and consumer indices sit on their own cache lines.
+template <typename T, size_t N, Overflow policy = Overflow::discardNewest,
+          typename Stats = NoStats>
+class StaticRing {
+public:
+  using CallBack = InplaceFunction<void(T &)>;
+  using TypedQueue =
+      detail::SpscFifo<T, detail::InlineStorage<T, N>, policy, Stats>;
+
+  StaticRing() = default;
+
+  constexpr size_t getSize() const noexcept { return N; }
+
+  // Wipes out the queue and resets it to its initial state
+  // Not thread safe!
+  void clear() { queue.clear(); }
+
+  // push an item into the queue
+  bool push(T const &item) { return queue.emplace(item); }
+
+  // push an item into the queue using move semantics
+  bool push(T &&item) { return queue.emplace(std::move(item)); }
+
+  // push an item into the queue using emplace semantics
+  template <typename... Args> bool emplace(Args &&...args) {
+    return queue.emplace(std::forward<Args>(args)...);
+  }
+
+  // push a block of items into the ring, publishing them all at once.
+  // Returns how many of them fit
+  size_t pushN(T const *items, size_t count) {
+    return queue.write(items, count);
+  }
+
+  // pop from the queue into item
+  bool pop(T &item) { return queue.pop(item); }
+
+  // pop up to maxCount items into dest at once. Returns how many were popped
+  size_t popN(T *dest, size_t maxCount) { return queue.read(dest, maxCount); }
+
+  // get a default constructed item in the next free slot to fill in place,
+  // or nullptr if full. Nothing is visible to the reader until commit()
+  T *reserve() { return queue.reserve(); }
+
+  // publish the item from reserve()
+  void commit() noexcept { queue.commit(); }
+
+  // look at the oldest item in place without popping it, or nullptr if empty
+  T *peek() noexcept { return queue.front(); }
+
+  // pop the item returned by peek()
+  void release() noexcept { queue.popFront(); }
+
+  // pop each item out of the queue and run a callback on it. The callback
+  // can be any callable taking a T &, and it sees the item in place
+  template <typename Fn> void forEach(Fn &&cbk) { queue.consumeAll(cbk); }
+
+  // pop each item out of the queue, but only run the callback on the last one
+  template <typename Fn> void forLast(Fn &&cbk) { queue.consumeLast(cbk); }
+
+  // how many items were overwritten since the last call, when the ring uses
+  // Overflow::overwriteOldest. Call from the consumer
+  size_t takeNumDropped() noexcept { return queue.takeNumDropped(); }
+
+  // the instrumentation, when Stats is QueueStats. Safe to read from any
+  // thread
+  const Stats &getStats() const noexcept { return queue.getStats(); }
+
+  // return a reference to the underlying queue
+  TypedQueue &getQueue() noexcept { return queue; }
+
+private:
+  TypedQueue queue;
+};
+
+// A Queue that any number of threads can push into at once, with a single
+// consumer. Bounded, never allocates after construction, and never takes a
+// lock, so the message thread, automation and network threads can all talk
+// to the audio thread through the same queue.
+template <typename T, typename Stats = NoStats> class MpscQueue {
+public:
+  using CallBack = InplaceFunction<void(T &)>;
+  using TypedQueue = detail::MpscFifo<T, Stats>;
+
+  MpscQueue(size_t s = 1024) : size(s), queue(s) {}
+
+  size_t getSize() const noexcept { return size; }
+
+  // Resize the queue, but deletes all existing data.
+  // Not thread safe!
+  void resize(int s) {
+    size = s;
+    queue.reset(size);
+  }
+
+  // Wipes out the queue and resets it to its initial state
+  // Not thread safe!
+  void clear() { queue.reset(size); }
+
+  // push an item into the queue from any thread
+  bool push(T const &item) { return queue.emplace(item); }
+
+  // push an item into the queue from any thread using move semantics
+  bool push(T &&item) { return queue.emplace(std::move(item)); }
+
+  // push an item into the queue from any thread using emplace semantics
+  template <typename... Args> bool emplace(Args &&...args) {
+    return queue.emplace(std::forward<Args>(args)...);
+  }
+
+  // pop from the queue into item
+  bool pop(T &item) { return queue.pop(item); }
+
+  // look at the oldest item in place without popping it, or nullptr if empty
+  T *peek() noexcept { return queue.front(); }
+
+  // pop the item returned by peek()
+  void release() noexcept { queue.popFront(); }
+
+  // pop each item out of the queue and run a callback on it. The callback
+  // can be any callable taking a T &, and it sees the item in place
+  template <typename Fn> void forEach(Fn &&cbk) {
+    while (auto *item = queue.front()) {
+      cbk(*item);
+      queue.popFront();
+    }
+  }
+
+  // pop each item out of the queue, but only run the callback on the last one
+  template <typename Fn> void forLast(Fn &&cbk) {
+    if (queue.front() == nullptr)
+      return;
+
+    while (queue.hasNext())
+      queue.popFront();
+
+    cbk(*queue.front());
+    queue.popFront();
+  }
+
+  // the instrumentation, when Stats is QueueStats. Safe to read from any
+  // thread
+  const Stats &getStats() const noexcept { return queue.getStats(); }
+
+  // return a reference to the underlying queue
+  TypedQueue &getQueue() noexcept { return queue; }
+
+private:
+  size_t size;
+  TypedQueue queue;
+};
+
+// The latest value of T, handed from one writer thread to one reader thread
+// through a triple buffer. The writer fills its own back buffer and swaps it
+// into the middle on publish(); the reader swaps the middle out for its front
+// buffer whenever something new was published. Neither side ever waits, the
+// reader only ever sees whole values, and values the reader never got to
+// are simply replaced. Good for meters and other GUI state that only needs to
+// be the latest, published once per block.
+template <typename T> class Snapshot {
+  static_assert(std::is_default_constructible_v<T>,
+                "T must be default constructible");
+
+public:
+  Snapshot() = default;
+
+  explicit Snapshot(const T &initial) {
+    for (auto &buffer : buffers)
+      buffer.value = initial;
+  }
+
+  //==== writer side
+
+  // The writer's private copy, to fill in place before publish()
+  T &getWriteBuffer() noexcept { return buffers[writer.index].value; }
+
+  // Hand the write buffer to the reader and take the stale one back
+  void publish() noexcept {
+    const auto previous =
+        middle.exchange(writer.index | dirtyFlag, std::memory_order_acq_rel);
+    writer.index = previous & indexMask;
+  }
+
+  void publish(const T &value) {
+    getWriteBuffer() = value;
+    publish();
+  }
+
+  //==== reader side
+
+  // Whether something was published since the last read()
+  bool hasNewData() const noexcept {
+    return (middle.load(std::memory_order_acquire) & dirtyFlag) != 0;
+  }
+
+  // The most recently published value. It stays valid and unchanged until
+  // the next call to read()
+  const T &read() noexcept {
+    if (hasNewData()) {
+      const auto previous =
+          middle.exchange(reader.index, std::memory_order_acq_rel);
+      reader.index = previous & indexMask;
+    }
+    return buffers[reader.index].value;
+  }
+
+private:
+  static constexpr int dirtyFlag = 4;
+  static constexpr int indexMask = 3;
+
+  struct alignas(detail::cacheLineSize) Buffer {
+    T value{};
+  };
+
+  struct alignas(detail::cacheLineSize) Side {
+    int index;
+  };
+
+  Buffer buffers[3];
+  Side writer{0};
+  Side reader{1};
+  alignas(detail::cacheLineSize) std::atomic<int> middle{2};
+};
+
+// A wakeup call that's safe to send from the audio thread. notify() is an
+// atomic check plus, only when the other thread is actually asleep, a post to
+// the OS semaphore (a futex on Linux), so it never takes a mutex or
+// allocates. Notifies sent before the waiter gets round to waiting collapse
+// into one.
+class Signal {
+public:
+  void notify() noexcept {
+    if (sema.availableApprox() <= 0)
+      sema.signal();
+  }
+
+  // Sleep until notified, or for at most timeoutMicros when that's not
+  // negative. Returns false on timeout
+  bool wait(juce::int64 timeoutMicros = -1) noexcept {
+    return timeoutMicros < 0 ? sema.wait() : sema.wait(timeoutMicros);
+  }
+
+private:
+  moodycamel::spsc_sema::LightweightSemaphore sema;
+};
+
+// How soon a loaded object is needed. Audible requests are built before any
+// prefetch work, which only fills in the gaps
+enum class LoadPriority { audible, prefetch };
+
+namespace detail {
+
+// Cancellation for the requests of one LoaderChannel, shared with the tickets
+// load() hands out. Cancelled sequence numbers go into a small ring indexed by
+// sequence, so cancel() is a single store from any thread. A cancellation can
+// only be lost if a request 256 newer is cancelled while it's still in
+// flight. With onlyUseLastMessage, every request is cancelled as soon as a
+// newer one of the same priority comes in. Closing cancels every request,
+// past and future, for when the channel's owner goes.
+class LoadState {
+public:
+  explicit LoadState(bool shouldOnlyUseLastMessage)
+      : onlyUseLastMessage(shouldOnlyUseLastMessage) {}
+
+  juce::uint64 nextSequence() noexcept {
+    return sequence.fetch_add(1, std::memory_order_relaxed) + 1;
+  }
+
+  void cancel(juce::uint64 seq) noexcept {
+    cancelled[seq & cancelledMask].store(seq, std::memory_order_release);
+  }
+
+  // Called once a request is queued, so it makes the older ones stale
+  void supersede(juce::uint64 seq, LoadPriority priority) noexcept {
+    if (!onlyUseLastMessage)
+      return;
+
+    auto &last = latest[(size_t)priority];
+    auto current = last.load(std::memory_order_relaxed);
+    while (current < seq &&
+           !last.compare_exchange_weak(current, seq, std::memory_order_release,
+                                       std::memory_order_relaxed)) {
+    }
+  }
+
+  void close() noexcept { closed.store(true); }
+  bool isClosed() const noexcept { return closed.load(); }
+
+  // Sequentially consistent against close(), so a build that's counted
+  // itself in before checking can't miss it
+  bool isCancelled(juce::uint64 seq, LoadPriority priority) const noexcept {
+    return closed.load() ||
+           cancelled[seq & cancelledMask].load(std::memory_order_acquire) ==
+               seq ||
+           (onlyUseLastMessage &&
+            seq < latest[(size_t)priority].load(std::memory_order_acquire));
+  }
+
+private:
+  static constexpr size_t numCancelled = 256;
+  static constexpr size_t cancelledMask = numCancelled - 1;
+
+  const bool onlyUseLastMessage;
+  std::atomic<bool> closed{false};
+  std::atomic<juce::uint64> sequence{0};
+  std::array<std::atomic<juce::uint64>, 2> latest{};
+  std::array<std::atomic<juce::uint64>, numCancelled> cancelled{};
+};
+
+} // namespace detail
+
+// What load() hands back: whether the request was queued, and a way to call
+// it off. Cheap to copy and safe to use from any thread, the audio thread
+// included, but it mustn't outlive the loader it came from.
+//
+// Objects that take a const LoadTicket & after their Options are given their
+// own ticket while they build, so long loads can check isCancelled() between
+// chunks and give up early. Whatever they return then is thrown away, though
+// a remainder it hands back still runs, with the cancelled ticket.
+class LoadTicket {
+public:
+  LoadTicket() noexcept = default;
+  LoadTicket(detail::LoadState &s, juce::uint64 seq,
+             LoadPriority p) noexcept
+      : state(&s), sequence(seq), priority(p) {}
+
+  // Whether the request made it into the queue
+  explicit operator bool() const noexcept { return state != nullptr; }
+
+  // Stop the request wherever it's got to. Safe to call more than once
+  void cancel() const noexcept {
+    if (state != nullptr)
+      state->cancel(sequence);
+  }
+
+  // Whether the request was cancelled or, with onlyUseLastMessage, overtaken
+  bool isCancelled() const noexcept {
+    return state != nullptr && state->isCancelled(sequence, priority);
+  }
+
+  LoadPriority getPriority() const noexcept { return priority; }
+
+private:
+  detail::LoadState *state = nullptr;
+  juce::uint64 sequence = 0;
+  LoadPriority priority = LoadPriority::audible;
+};
+
+namespace detail {
+
+// Whether T has a makeResident() for the loader to call before publishing it
+template <typename T, typename = void>
+struct HasMakeResident : std::false_type {};
+template <typename T>
+struct HasMakeResident<
+    T, std::void_t<decltype(std::declval<T &>().makeResident())>>
+    : std::true_type {};
+
+// Whether T has a takeRemainder() for the loader to run after publishing it.
+// It hands back a callable that does the next piece of the work and returns
+// whether there's more, so the pool can run it a piece at a time
+template <typename T, typename = void> struct HasRemainder : std::false_type {};
+template <typename T>
+struct HasRemainder<
+    T, std::void_t<decltype(std::declval<T &>().takeRemainder())>>
+    : std::true_type {};
+
+// A unit of work for a JobPool
+class Job {
+public:
+  virtual ~Job() = default;
+  virtual void run() = 0;
+};
+
+// Runs Jobs on the thread that owns it plus numHelpers helper threads. The
+// owner submits jobs to work-stealing deques, one per priority, and works
+// through them from the bottom while the helpers steal from the top. With no
+// helpers, audible jobs run inline in submit(), in order, and prefetch jobs
+// wait for helpOut().
+class JobPool {
+public:
+  JobPool(const juce::String &name, size_t capacity, int numHelpers)
+      : audible(capacity), prefetch(capacity) {
+    for (int i = 1; i <= numHelpers; ++i)
+      helpers.push_back(
+          std::make_unique<Helper>(*this, name + " worker " + juce::String(i)));
+  }
+
+  ~JobPool() { stop(); }
+
+  JobPool(const JobPool &) = delete;
+  JobPool &operator=(const JobPool &) = delete;
+
+  // The number of threads running jobs, including the owner
+  int getNumThreads() const noexcept { return (int)helpers.size() + 1; }
+
+  //==== owner thread only
+
+  void start() {
+    for (auto &helper : helpers)
+      helper->startThread();
+  }
+
+  // Queue a job for whichever thread gets to it first. If the deque is full
+  // the owner runs it here and now
+  void submit(std::unique_ptr<Job> job, LoadPriority priority) {
+    const auto runNow =
+        priority == LoadPriority::audible && helpers.empty();
+    if (runNow || !getDeque(priority).push(job.get())) {
+      job->run();
+      return;
+    }
+
+    job.release();
+  }
+
+  // Wake the helpers, work through the audible jobs they haven't stolen and
+  // then run one prefetch job. Returns whether that found a prefetch job, in
+  // which case there may be more, but the owner should look for new
+  // requests first
+  bool helpOut() {
+    for (auto &helper : helpers)
+      helper->wakeUp.notify();
+
+    Job *job;
+    while (audible.pop(job))
+      runAndDelete(job);
+
+    if (!prefetch.pop(job))
+      return false;
+
+    runAndDelete(job);
+    return true;
+  }
+
+  // Stop the helpers and drop the jobs nobody got round to
+  void stop() {
+    for (auto &helper : helpers)
+      helper->signalThreadShouldExit();
+    for (auto &helper : helpers)
+      helper->waitForThreadToExit(-1);
+
+    Job *job;
+    while (audible.pop(job) || prefetch.pop(job))
+      delete job;
+  }
+
+private:
+  class Helper : public juce::Thread, private juce::Thread::Listener {
+  public:
+    Helper(JobPool &p, const juce::String &name)
+        : juce::Thread(name), pool(p) {
+      addListener(this);
+    }
+
+    ~Helper() override {
+      stopThread(-1);
+      removeListener(this);
+    }
+
+    void run() override {
+      while (!threadShouldExit()) {
+        Job *job;
+        while (pool.audible.steal(job) || pool.prefetch.steal(job))
+          runAndDelete(job);
+
+        wakeUp.wait();
+      }
+    }
+
+    Signal wakeUp;
+
+  private:
+    void exitSignalSent() override { wakeUp.notify(); }
+
+    JobPool &pool;
+  };
+
+  WorkStealingDeque<Job *> &getDeque(LoadPriority priority) noexcept {
+    return priority == LoadPriority::audible ? audible : prefetch;
+  }
+
+  static void runAndDelete(Job *job) {
+    std::unique_ptr<Job> owned(job);
+    owned->run();
+  }
+
+  WorkStealingDeque<Job *> audible, prefetch;
+
+  // Declared last so they're stopped before the deques go away
+  std::vector<std::unique_ptr<Helper>> helpers;
+};
+
+// The loader side of a LoaderChannel, whatever it builds, so one pool thread
+// can serve channels of every type
+class JobSource {
+public:
+  virtual ~JobSource() = default;
+
+  // Turn the waiting requests that are still wanted into jobs
+  virtual void dispatch(JobPool &pool) = 0;
+
+  // Destroy objects that are no longer used
+  virtual void destroyPending() = 0;
+
+  // Whether the owner has gone and nothing it started is still running
+  virtual bool isFinished() const = 0;
+};
+
+// The queues between one user of a loader and the threads building its
+// objects. The user side is wait-free; the loader side turns requests into
+// Jobs for a JobPool. Cancelled requests are skipped before, and dropped
+// after, building on whichever thread ran them. Always owned by a
+// shared_ptr, since jobs in flight keep it alive.
+template <typename T, typename Options,
+          template <typename...> class RequestQueue, typename Stats>
+class LoaderChannel
+    : public JobSource,
+      public std::enable_shared_from_this<
+          LoaderChannel<T, Options, RequestQueue, Stats>> {
+  static_assert(std::is_constructible_v<T, Options> ||
+                    std::is_constructible_v<T, const Options &,
+                                            const LoadTicket &>,
+                "T must be constructible with Options");
+  static_assert(std::is_default_constructible_v<Options>,
+                "Options must be default constructible");
+
+public:
+  // A load() call on its way to the loader thread
+  struct Request {
+    Request() = default;
+    Request(Options &&o, juce::uint64 s, LoadPriority p)
+        : options(std::move(o)), sequence(s), priority(p) {}
+    Request(const Options &o, juce::uint64 s, LoadPriority p)
+        : options(o), sequence(s), priority(p) {}
+
+    Options options;
+    juce::uint64 sequence = 0;
+    LoadPriority priority = LoadPriority::audible;
+  };
+
+  using ObjPtr = std::unique_ptr<T>;
+  using OptionsQueue = RequestQueue<Request, Stats>;
+  using ObjectQueue = MpscQueue<ObjPtr, Stats>;
+  using DestroyQueue = Queue<ObjPtr, Stats>;
+
+  // The next piece of the work left over once an object is published.
+  // Returns whether there's more
+  using Remainder = std::function<bool()>;
+  using RemainderQueue = MpscQueue<Remainder>;
+
+  LoaderChannel(size_t initialSize, bool shouldOnlyUseLastMessage,
+                Signal &loaderWakeUp)
+      : state(shouldOnlyUseLastMessage), toLoad(initialSize),
+        loaded(initialSize), toDestroy(initialSize), toFinish(initialSize),
+        wakeUp(loaderWakeUp) {}
+
+  //==== user side
+
+  LoadTicket load(Options &&creator, LoadPriority priority) {
+    const auto sequence = state.nextSequence();
+    if (!toLoad.emplace(std::move(creator), sequence, priority))
+      return {};
+
+    return queued(sequence, priority);
+  }
+
+  LoadTicket load(const Options &creator, LoadPriority priority) {
+    const auto sequence = state.nextSequence();
+    if (!toLoad.emplace(creator, sequence, priority))
+      return {};
+
+    return queued(sequence, priority);
+  }
+
+  bool destroy(ObjPtr &&object) {
+    if (!toDestroy.push(std::move(object)))
+      return false;
+
+    wakeUp.notify();
+    return true;
+  }
+
+  bool getLoaded(ObjPtr &loadedT) { return loaded.pop(loadedT); }
+
+  template <typename Fn> void forEach(Fn &&cbk) {
+    loaded.forEach([&](ObjPtr &t) { cbk(std::move(t)); });
+  }
+
+  const Stats &getRequestStats() const noexcept { return toLoad.getStats(); }
+  const Stats &getResultStats() const noexcept { return loaded.getStats(); }
+
+  // Cancel everything and wait for any build that's already started to
+  // finish, so nothing reaches into the owner's Options once it's gone.
+  // Jobs still queued may hold the channel for a while after this, but
+  // they see the requests are cancelled. Remainders carry on, since other
+  // users may share what they finish. Not for the audio thread
+  void close() {
+    state.close();
+    while (numBuilding.load() > 0)
+      juce::Thread::yield();
+
+    wakeUp.notify();
+  }
+
+  //==== loader side
+
+  void dispatch(JobPool &pool) override {
+    // Leftover work waits behind anything that's needed now
+    Remainder remainder;
+    while (toFinish.pop(remainder))
+      pool.submit(std::make_unique<RemainderJob>(this->shared_from_this(),
+                                                 std::move(remainder)),
+                  LoadPriority::prefetch);
+
+    Request request;
+    while (toLoad.pop(request)) {
+      if (state.isCancelled(request.sequence, request.priority))
+        continue;
+
+      const auto priority = request.priority;
+      pool.submit(std::make_unique<BuildJob>(this->shared_from_this(),
+                                             std::move(request)),
+                  priority);
+    }
+  }
+
+  void destroyPending() override {
+    toDestroy.forEach([](ObjPtr &object) { object.reset(); });
+  }
+
+  bool isFinished() const override {
+    return state.isClosed() && numRemainders.load() == 0;
+  }
+
+private:
+  class BuildJob : public Job {
+  public:
+    BuildJob(std::shared_ptr<LoaderChannel> c, Request &&r)
+        : channel(std::move(c)), request(std::move(r)) {}
+
+    void run() override { channel->build(request); }
+
+  private:
+    std::shared_ptr<LoaderChannel> channel;
+    Request request;
+  };
+
+  // One piece of an object's remainder
+  class RemainderJob : public Job {
+  public:
+    RemainderJob(std::shared_ptr<LoaderChannel> c, Remainder &&r)
+        : channel(std::move(c)), remainder(std::move(r)) {}
+
+    void run() override {
+      if (remainder())
+        channel->finishLater(std::move(remainder));
+      else
+        --channel->numRemainders;
+    }
+
+  private:
+    std::shared_ptr<LoaderChannel> channel;
+    Remainder remainder;
+  };
+
+  // Hand the rest of a remainder to the thread that owns the JobPool, the
+  // only one that can submit it. Whichever thread runs it can call this.
+  // If the queue is full, the rest runs here rather than getting lost
+  void finishLater(Remainder &&remainder) {
+    while (!toFinish.push(std::move(remainder))) {
+      if (!remainder()) {
+        --numRemainders;
+        return;
+      }
+    }
+
+    wakeUp.notify();
+  }
+
+  LoadTicket queued(juce::uint64 sequence, LoadPriority priority) {
+    state.supersede(sequence, priority);
+    wakeUp.notify();
+    return {state, sequence, priority};
+  }
+
+  // Counts a build in, for close() to wait on
+  class Building {
+  public:
+    explicit Building(std::atomic<int> &n) : count(n) { ++count; }
+    ~Building() { --count; }
+
+  private:
+    std::atomic<int> &count;
+  };
+
+  // Runs on the loader thread or any helper
+  void build(const Request &request) {
+    const Building building(numBuilding);
+    const LoadTicket ticket(state, request.sequence, request.priority);
+    if (ticket.isCancelled())
+      return;
+
+    ObjPtr object;
+    if constexpr (std::is_constructible_v<T, const Options &,
+                                          const LoadTicket &>)
+      object = std::make_unique<T>(request.options, ticket);
+    else
+      object = std::make_unique<T>(request.options);
+
+    // Objects that are usable before they're finished hand back the rest of
+    // the work, which carries on in prefetch jobs once the object is on its
+    // way, so a long one never holds up requests behind it. It runs whether
+    // or not the object gets published, since it may be finishing data that
+    // other users share; a cancelled ticket stops whatever only this object
+    // would have used
+    if constexpr (HasRemainder<T>::value) {
+      if (auto remainder = object->takeRemainder()) {
+        ++numRemainders;
+        finishLater(std::move(remainder));
+      }
+    }
+
+    if (ticket.isCancelled())
+      return;
+
+    // Fault its memory in here rather than in the first processBlock
+    if constexpr (HasMakeResident<T>::value)
+      object->makeResident();
+
+    loaded.push(std::move(object));
+  }
+
+  // Cancellation, shared with the tickets
+  LoadState state;
+
+  // Some other thread (the GUI or audio thread, but not both, unless
+  // RequestQueue is MpscQueue) writes requests, the loader consumes them in
+  // its own thread
+  OptionsQueue toLoad;
+
+  // The loader and its helpers push objects to this queue after creating
+  // them, and the audio thread consumes them
+  ObjectQueue loaded;
+
+  // The audio thread pushes objects to this queue, the loader destroys them
+  // in its own thread
+  DestroyQueue toDestroy;
+
+  // Whichever thread built an object, or ran the last piece of its
+  // remainder, pushes the rest here for the loader to submit
+  RemainderQueue toFinish;
+
+  // Wakes the loader thread when there's something to do
+  Signal &wakeUp;
+
+  // The builds running right now, on any thread
+  std::atomic<int> numBuilding{0};
+
+  // Remainders that haven't finished, wherever they are
+  std::atomic<int> numRemainders{0};
+};
+
+} // namespace detail
+
+// Builds objects of type T from Options on its own thread and hands them to
+// the audio thread. Requests go through a single producer Queue by default;
+// pass MpscQueue as RequestQueue to accept load() calls from several threads
+// at once. Pass QueueStats as Stats to instrument the request and result
+// queues.
+//
+// With numWorkers above one, the loader thread hands requests out through
+// work-stealing deques and numWorkers - 1 helper threads build objects in
+// parallel with it. Objects then arrive in whatever order they finish.
+//
+// load() returns a LoadTicket that can cancel the request, and takes a
+// priority so prefetching never holds up a sound that's needed now. With
+// onlyUseLastMessage, a new request cancels the older ones of the same
+// priority, even if they're already being built.
+//
+// load() and destroy() only touch bounded queues and a Signal, so both are
+// wait-free and safe to call from processBlock.
+template <typename T, typename Options,
+          template <typename...> class RequestQueue = Queue,
+          typename Stats = NoStats>
+class Loader : public juce::Thread, private juce::Thread::Listener {
+  using Channel = detail::LoaderChannel<T, Options, RequestQueue, Stats>;
+
+public:
+  // A unique pointer to the object type
+  using ObjPtr = typename Channel::ObjPtr;
+
+  // A queue with a single reader for object creation. Whether it takes one
+  // writer or many depends on RequestQueue.
+  // The options for initializing the object are their own type
+  // and the object's initializer should take that type as an argument,
+  // optionally followed by a const LoadTicket &
+  using OptionsQueue = typename Channel::OptionsQueue;
+
+  // A single reader queue for the objects themselves used to pass the
+  // objects back to the audio thread. Every worker writes to it
+  using ObjectQueue = typename Channel::ObjectQueue;
+
+  // A single reader single writer queue for objects on their way to be
+  // destroyed. Fixed size, so pushing never allocates
+  using DestroyQueue = typename Channel::DestroyQueue;
+
+  // A callback for when an object is grabbed from the queue by the
+  // audio thread. The object is passed as an ObjPtr
+  using CallBack = InplaceFunction<void(ObjPtr)>;
+
+  // numWorkers counts the loader thread itself, so the default of one
+  // builds everything on the loader thread in request order
+  Loader(const juce::String &name, size_t initialSize = 25,
+         bool shouldOnlyUseLastMessage = false, int numWorkers = 1)
+      : juce::Thread(name),
+        channel(std::make_shared<Channel>(initialSize,
+                                          shouldOnlyUseLastMessage, wakeUp)),
+        jobs(name, initialSize, numWorkers - 1) {
+    addListener(this);
+  }
+
+  // Load options into the queue for creation. The ticket is false if the
+  // queue was full
+  LoadTicket load(Options &&creator,
+                  LoadPriority priority = LoadPriority::audible) {
+    return channel->load(std::move(creator), priority);
+  }
+
+  // Load options into the queue for creation. The ticket is false if the
+  // queue was full
+  LoadTicket load(const Options &creator,
+                  LoadPriority priority = LoadPriority::audible) {
+    return channel->load(creator, priority);
+  }
+
+  // Queue an object for destruction on the loader thread. If the queue is
+  // full, this returns false and leaves the object with the caller, who
+  // should hold on to it and try again on a later block rather than delete
+  // it on the audio thread
+  bool destroy(ObjPtr &&object) { return channel->destroy(std::move(object)); }
+
+  // Pop a single loaded object from the queue
+  bool getLoaded(ObjPtr &loadedT) { return channel->getLoaded(loadedT); }
+
+  // For each loaded object, run a callback on that object. The callback can
+  // be any callable taking an ObjPtr
+  template <typename Fn> void forEach(Fn &&cbk) {
+    channel->forEach(std::forward<Fn>(cbk));
+  }
+
+  // Instrumentation for the requests from load(), when Stats is QueueStats.
+  // Rejections are load() calls that didn't fit
+  const Stats &getRequestStats() const noexcept {
+    return channel->getRequestStats();
+  }
+
+  // Instrumentation for the objects waiting for the audio thread. Rejections
+  // are objects that were built but had nowhere to go
+  const Stats &getResultStats() const noexcept {
+    return channel->getResultStats();
+  }
+
+  // The number of threads building objects, including the loader thread
+  int getNumWorkers() const noexcept { return jobs.getNumThreads(); }
+
+  // Start the loader background thread. The helper workers live as long as
+  // it does
+  void run() override {
+    jobs.start();
+
+    while (true) {
+      if (threadShouldExit())
+        break;
+
+      const auto moreToDo = loadAndDestroy();
+
+      if (threadShouldExit())
+        break;
+
+      if (!moreToDo)
+        wakeUp.wait();
+    }
+
+    jobs.stop();
+  }
+
+  ~Loader() override {
+    stopThread(-1);
+    removeListener(this);
+  }
+
+private:
+  // stopThread() and signalThreadShouldExit() land here, so the thread wakes
+  // up to see it should exit
+  void exitSignalSent() override { wakeUp.notify(); }
+
+  // Returns whether there's prefetch work left
+  bool loadAndDestroy() {
+    channel->dispatch(jobs);
+    const auto moreToDo = jobs.helpOut();
+    channel->destroyPending();
+    return moreToDo;
+  }
+
+  // Wakes the loader thread when there's something to do
+  Signal wakeUp;
+
+  // The queues to and from the audio thread
+  std::shared_ptr<Channel> channel;
+
+  // The helper workers and the deque they steal from. Declared last so
+  // they're stopped before anything they use goes away
+  detail::JobPool jobs;
+};
+
+// The threads behind every SharedLoader in a process, whatever it loads. One
+// pool thread collects requests from every client's channel and builds them
+// together with a fixed set of helpers, so the thread count follows the
+// number of cores rather than the number of plugin instances or sound
+// types. Created with the first SharedLoader and stopped with the last,
+// through juce::SharedResourcePointer.
+class LoaderPool : private juce::Thread, private juce::Thread::Listener {
+public:
+  // A thread per core, leaving one for the audio thread
+  static int getDefaultNumWorkers() {
+    return juce::jmax(1, juce::SystemStats::getNumCpus() - 1);
+  }
+
+  explicit LoaderPool(int numWorkers = getDefaultNumWorkers())
+      : juce::Thread("LoaderPool"), jobs("LoaderPool", 256, numWorkers - 1) {
+    addListener(this);
+    startThread();
+  }
+
+  ~LoaderPool() override {
+    stopThread(-1);
+    removeListener(this);
+  }
+
+  // The number of threads building objects, including the pool thread
+  int getNumWorkers() const noexcept { return jobs.getNumThreads(); }
+
+  // Start serving a channel. It's served until it's closed and has nothing
+  // left to finish. Not for the audio thread, since this takes a lock shared
+  // with the pool thread
+  void add(std::shared_ptr<detail::JobSource> channel) {
+    const juce::ScopedLock sl(lock);
+    channels.push_back(std::move(channel));
+  }
+
+  // What the channels notify when they have something to do
+  Signal &getWakeUp() noexcept { return wakeUp; }
+
+private:
+  void run() override {
+    jobs.start();
+
+    while (!threadShouldExit()) {
+      // Work on a copy, so building doesn't hold up add()
+      {
+        const juce::ScopedLock sl(lock);
+        current = channels;
+      }
+
+      for (auto &channel : current)
+        channel->dispatch(jobs);
+
+      const auto moreToDo = jobs.helpOut();
+
+      for (auto &channel : current)
+        channel->destroyPending();
+
+      current.clear();
+      dropFinished();
+
+      if (threadShouldExit())
+        break;
+
+      if (!moreToDo)
+        wakeUp.wait();
+    }
+
+    jobs.stop();
+  }
+
+  void exitSignalSent() override { wakeUp.notify(); }
+
+  void dropFinished() {
+    const juce::ScopedLock sl(lock);
+    channels.erase(
+        std::remove_if(channels.begin(), channels.end(),
+                       [](const std::shared_ptr<detail::JobSource> &c) {
+                         return c->isFinished();
+                       }),
+        channels.end());
+  }
+
+  juce::CriticalSection lock;
+  std::vector<std::shared_ptr<detail::JobSource>> channels, current;
+  Signal wakeUp;
+  detail::JobPool jobs;
+};
+
+// A Loader without a thread of its own. Requests and results go through this
+// instance's own queues, but the objects are built on the process-wide
+// LoaderPool, which every SharedLoader shares whatever it loads. Use it
+// instead of Loader when there can be many plugin instances in one process.
+template <typename T, typename Options,
+          template <typename...> class RequestQueue = Queue,
+          typename Stats = NoStats>
+class SharedLoader {
+public:
+  using Pool = LoaderPool;
+  using Channel = detail::LoaderChannel<T, Options, RequestQueue, Stats>;
+  using ObjPtr = typename Channel::ObjPtr;
+  using CallBack = InplaceFunction<void(ObjPtr)>;
+
+  explicit SharedLoader(size_t initialSize = 25,
+                        bool shouldOnlyUseLastMessage = false)
+      : channel(std::make_shared<Channel>(
+            initialSize, shouldOnlyUseLastMessage, pool->getWakeUp())) {
+    pool->add(channel);
+  }
+
+  // Waits for any of this loader's objects that are being built, since the
+  // pool outlives it and its Options may point into the owner. The pool
+  // drops the channel once its remainders are done
+  ~SharedLoader() { channel->close(); }
+
+  SharedLoader(const SharedLoader &) = delete;
+  SharedLoader &operator=(const SharedLoader &) = delete;
+
+  // Load options into the queue for creation
+  LoadTicket load(Options &&creator,
+                  LoadPriority priority = LoadPriority::audible) {
+    return channel->load(std::move(creator), priority);
+  }
+
+  // Load options into the queue for creation
+  LoadTicket load(const Options &creator,
+                  LoadPriority priority = LoadPriority::audible) {
+    return channel->load(creator, priority);
+  }
+
+  // Queue an object for destruction on the pool thread. Returns false and
+  // leaves the object with the caller when the queue is full
+  bool destroy(ObjPtr &&object) { return channel->destroy(std::move(object)); }
+
+  // Pop a single loaded object from the queue
+  bool getLoaded(ObjPtr &loadedT) { return channel->getLoaded(loadedT); }
+
+  // For each loaded object, run a callback on that object
+  template <typename Fn> void forEach(Fn &&cbk) {
+    channel->forEach(std::forward<Fn>(cbk));
+  }
+
+  const Stats &getRequestStats() const noexcept {
+    return channel->getRequestStats();
+  }
+
+  const Stats &getResultStats() const noexcept {
+    return channel->getResultStats();
+  }
+
+  Pool &getPool() noexcept { return *pool; }
+
+private:
+  juce::SharedResourcePointer<Pool> pool;
+  std::shared_ptr<Channel> channel;
+};
+
+// Keeps sample memory resident, so the audio thread never takes a page fault
+// on a sound it's just been handed, whether the page was swapped out or
+// never read in from a mapped file. Every region is read a page at a time,
+// and its whole pages are also mlock()ed while the process-wide budget
+// allows it. Once the OS refuses, which is usually RLIMIT_MEMLOCK, it only
+// touches until something is unlocked again. There's no locking on Windows.
+class ResidentMemory {
+public:
+  // Unlocks its pages when it goes. Empty if nothing was locked
+  class Lock {
+  public:
+    Lock() = default;
+    Lock(Lock &&other) noexcept
+        : start(std::exchange(other.start, nullptr)),
+          numBytes(std::exchange(other.numBytes, 0)) {}
+    Lock &operator=(Lock &&other) noexcept {
+      if (this != &other) {
+        release();
+        start = std::exchange(other.start, nullptr);
+        numBytes = std::exchange(other.numBytes, 0);
+      }
+      return *this;
+    }
+    ~Lock() { release(); }
+
+    explicit operator bool() const { return start != nullptr; }
+
+  private:
+    friend class ResidentMemory;
+    Lock(const void *lockedStart, size_t lockedBytes)
+        : start(lockedStart), numBytes(lockedBytes) {}
+
+    void release() {
+      if (start == nullptr)
+        return;
+
+#if !JUCE_WINDOWS
+      munlock(start, numBytes);
+#endif
+      getInstance().unlocked(numBytes);
+      start = nullptr;
+    }
+
+    const void *start = nullptr;
+    size_t numBytes = 0;
+  };
+
+  static ResidentMemory &getInstance() {
+    static ResidentMemory instance;
+    return instance;
+  }
+
+  // The most that may be locked at once, or 0 to only ever touch
+  void setBudget(size_t bytes) { budget.store(bytes); }
+  size_t getBudget() const { return budget.load(); }
+  size_t getLockedBytes() const { return locked.load(); }
+
+  // Call from a loader thread, before the memory goes to the audio thread
+  Lock makeResident(const void *data, size_t numBytes) {
+    touch(data, numBytes);
+
+#if JUCE_WINDOWS
+    return {};
+#else
+    // Only pages that lie wholly inside the region, so unlocking never
+    // unlocks a page something else has locked too
+    const auto pageSize = (std::uintptr_t)sysconf(_SC_PAGESIZE);
+    const auto from = reinterpret_cast<std::uintptr_t>(data);
+    const auto first = (from + pageSize - 1) / pageSize * pageSize;
+    const auto last = (from + numBytes) / pageSize * pageSize;
+    if (last <= first || refused.load())
+      return {};
+
+    const auto lockBytes = (size_t)(last - first);
+    auto current = locked.load();
+    do {
+      if (current + lockBytes > budget.load())
+        return {};
+    } while (!locked.compare_exchange_weak(current, current + lockBytes));
+
+    const auto *start = reinterpret_cast<const void *>(first);
+    if (mlock(start, lockBytes) != 0) {
+      locked.fetch_sub(lockBytes);
+      refused.store(true);
+      return {};
+    }
+
+    return Lock(start, lockBytes);
+#endif
+  }
+
+  // Read a byte from every page, faulting in any that aren't there
+  static void touch(const void *data, size_t numBytes) {
+    constexpr size_t stride = 4096;
+    const auto *bytes = static_cast<const volatile char *>(data);
+    for (size_t offset = 0; offset < numBytes; offset += stride)
+      (void)bytes[offset];
+    if (numBytes > 0)
+      (void)bytes[numBytes - 1];
+  }
+
+private:
+  ResidentMemory() = default;
+
+  void unlocked(size_t numBytes) {
+    locked.fetch_sub(numBytes);
+    refused.store(false);
+  }
+
+  std::atomic<size_t> budget{std::numeric_limits<size_t>::max()};
+  std::atomic<size_t> locked{0};
+  std::atomic<bool> refused{false};
+};
+
+class WaveformPyramid;
+class SampleAnalysis;
+
+// Decoded audio, shared between every LoadableSound made from the same file
+// through the SamplePool and SampleCaches. A progressive load keeps writing
+// past numSamplesReady after the sound is handed over; everything below it
+// never changes again, so any number of threads can read it at once
+struct SampleData {
+  using Ptr = std::shared_ptr<const SampleData>;
+
+  // How the samples are held. The integer formats keep each channel in
+  // packed, one after another, and leave buffer empty
+  enum class Storage { float32, int16, int24 };
+
+  // Make room for every sample, uninitialised
+  void allocate(Storage newStorage, int channels, int samples) {
+    storage = newStorage;
+    numChannels = channels;
+    numSamples = samples;
+    if (storage == Storage::float32) {
+      buffer.setSize(channels, samples);
+    } else {
+      packed.malloc(getNumBytes());
+      packedData = packed.get();
+    }
+  }
+
+  // Use complete samples laid out the same way at start inside a mapped
+  // file, rather than a copy. They're never written again
+  void refer(std::unique_ptr<juce::MemoryMappedFile> file, const void *start,
+             Storage newStorage, int channels, int samples) {
+    storage = newStorage;
+    numChannels = channels;
+    numSamples = samples;
+    mapping = std::move(file);
+
+    const auto *bytes = static_cast<const char *>(start);
+    if (storage == Storage::float32) {
+      std::vector<float *> channelStarts;
+      for (int channel = 0; channel < channels; ++channel)
+        channelStarts.push_back(const_cast<float *>(
+            reinterpret_cast<const float *>(bytes) +
+            (size_t)channel * (size_t)samples));
+      buffer.setDataToReferTo(channelStarts.data(), channels, samples);
+    } else {
+      packedData = bytes;
+    }
+
+    numSamplesReady.store(samples, std::memory_order_release);
+  }
+
+  // Move float data into a compact storage, once it's all there
+  void pack(Storage newStorage) {
+    if (storage != Storage::float32 || newStorage == storage)
+      return;
+
+    auto floats = std::move(buffer);
+    allocate(newStorage, numChannels, numSamples);
+    for (int channel = 0; channel < numChannels; ++channel)
+      write(channel, 0, floats.getReadPointer(channel), numSamples);
+  }
+
+  // Store float samples from start on in one channel, converting them to
+  // the storage format
+  void write(int channel, int start, const float *source, int num) {
+    using namespace juce;
+    switch (storage) {
+    case Storage::float32:
+      FloatVectorOperations::copy(buffer.getWritePointer(channel, start),
+                                  source, num);
+      break;
+    case Storage::int16:
+      convert<AudioData::Float32, AudioData::Int16>(
+          source, packedSample(channel, start), num);
+      break;
+    case Storage::int24:
+      convert<AudioData::Float32, AudioData::Int24>(
+          source, packedSample(channel, start), num);
+      break;
+    }
+  }
+
+  // Fetch samples from start on in one channel back as floats
+  void read(int channel, int start, float *dest, int num) const {
+    using namespace juce;
+    switch (storage) {
+    case Storage::float32:
+      FloatVectorOperations::copy(dest, buffer.getReadPointer(channel, start),
+                                  num);
+      break;
+    case Storage::int16:
+      convert<AudioData::Int16, AudioData::Float32>(
+          packedSample(channel, start), dest, num);
+      break;
+    case Storage::int24:
+      convert<AudioData::Int24, AudioData::Float32>(
+          packedSample(channel, start), dest, num);
+      break;
+    }
+  }
+
+  int getNumChannels() const { return numChannels; }
+  int getNumSamples() const { return numSamples; }
+
+  static size_t getBytesPerSample(Storage format) {
+    switch (format) {
+    case Storage::int16:
+      return 2;
+    case Storage::int24:
+      return 3;
+    default:
+      return sizeof(float);
+    }
+  }
+  size_t getBytesPerSample() const { return getBytesPerSample(storage); }
+
+  size_t getNumBytes() const {
+    return (size_t)numChannels * (size_t)numSamples * getBytesPerSample();
+  }
+
+  // Where the samples start. An AudioBuffer's channels are one allocation
+  // too, so either way the whole lot is getNumBytes() from here
+  const void *getFirstSample() const {
+    if (numChannels == 0)
+      return nullptr;
+    if (storage == Storage::float32)
+      return buffer.getReadPointer(0);
+    return packedData;
+  }
+
+  // Work out everything that needs all the samples, once they're there.
+  // Only ever called once, by whichever loader thread completes the data
+  void complete();
+
+  // Take what an earlier complete() worked out, as the disk cache keeps it,
+  // rather than working it out again
+  void complete(std::unique_ptr<WaveformPyramid> storedOverview,
+                std::unique_ptr<SampleAnalysis> storedAnalysis);
+
+  // For drawing, or nullptr until the data is complete
+  const WaveformPyramid *getOverview() const {
+    return overview.load(std::memory_order_acquire);
+  }
+
+  // Levels and timings, or nullptr until the data is complete
+  const SampleAnalysis *getAnalysis() const {
+    return analysis.load(std::memory_order_acquire);
+  }
+
+  // Lock the samples in memory once they have their final size, before
+  // anyone else can see them
+  void lockPages() {
+    if (numChannels > 0)
+      pages = ResidentMemory::getInstance().makeResident(getFirstSample(),
+                                                         getNumBytes());
+  }
+
+  Storage storage = Storage::float32;
+  juce::AudioBuffer<float> buffer;
+  juce::HeapBlock<char> packed;
+  std::unique_ptr<juce::MemoryMappedFile> mapping;
+  double sampleRate = 0.0;
+  std::atomic<int> numSamplesReady{0};
+  ResidentMemory::Lock pages;
+
+private:
+  std::unique_ptr<WaveformPyramid> overviewStorage;
+  std::atomic<const WaveformPyramid *> overview{nullptr};
+  std::unique_ptr<SampleAnalysis> analysisStorage;
+  std::atomic<const SampleAnalysis *> analysis{nullptr};
+
+  template <typename From, typename To>
+  static void convert(const void *source, void *dest, int num) {
+    using namespace juce;
+    using Source = AudioData::Pointer<From, AudioData::NativeEndian,
+                                      AudioData::NonInterleaved,
+                                      AudioData::Const>;
+    using Dest = AudioData::Pointer<To, AudioData::NativeEndian,
+                                    AudioData::NonInterleaved,
+                                    AudioData::NonConst>;
+    Dest(dest).convertSamples(Source(source), num);
+  }
+
+  const char *packedSample(int channel, int index) const {
+    return packedData +
+           ((size_t)channel * (size_t)numSamples + (size_t)index) *
+               getBytesPerSample();
+  }
+  char *packedSample(int channel, int index) {
+    return packed.get() +
+           ((size_t)channel * (size_t)numSamples + (size_t)index) *
+               getBytesPerSample();
+  }
+
+  const char *packedData = nullptr;
+  int numChannels = 0;
+  int numSamples = 0;
+};
+
+namespace detail {
+// Plain values to and from the bytes DiskSampleCache keeps after the
+// samples, in native byte order like the samples themselves
+class ByteWriter {
+public:
+  explicit ByteWriter(std::vector<char> &destination) : bytes(destination) {}
+
+  template <typename T> void write(const T &value) { write(&value, 1); }
+
+  template <typename T> void write(const T *values, size_t count) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    const auto *first = reinterpret_cast<const char *>(values);
+    bytes.insert(bytes.end(), first, first + count * sizeof(T));
+  }
+
+private:
+  std::vector<char> &bytes;
+};
+
+// Reading past the end, or any count that doesn't fit what's left, fails
+// every read after it rather than reading out of bounds
+class ByteReader {
+public:
+  ByteReader(const void *start, size_t numBytes)
+      : position(static_cast<const char *>(start)),
+        end(position + numBytes) {}
+
+  template <typename T> bool read(T &value) { return read(&value, 1); }
+
+  template <typename T> bool read(T *values, size_t count) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    if (!hasRoomFor<T>(count)) {
+      ok = false;
+      return false;
+    }
+
+    if (count > 0) {
+      std::memcpy(values, position, count * sizeof(T));
+      position += count * sizeof(T);
+    }
+    return true;
+  }
+
+  // Whether count more Ts are there to read, to check before allocating
+  // room for them
+  template <typename T> bool hasRoomFor(size_t count) const {
+    return ok && count <= (size_t)(end - position) / sizeof(T);
+  }
+
+  // Whether every read so far worked
+  bool isOk() const { return ok; }
+  bool isExhausted() const { return position == end; }
+
+private:
+  const char *position;
+  const char *end;
+  bool ok = true;
+};
+} // namespace detail
+
+// Min, max and RMS of a sound at every power-of-two zoom, so drawing its
+// waveform at any size costs a handful of bins per pixel rather than a pass
+// over the samples. Level 0 sums up blocks of baseBlockSize samples and every
+// level above merges pairs from the one below, so any range is covered by at
+// most two bins a level. Views zoomed in past baseBlockSize samples per pixel
+// should read the samples instead.
+class WaveformPyramid {
+public:
+  struct Bin {
+    float min = 0.0f;
+    float max = 0.0f;
+    float meanSquare = 0.0f;
+
+    float getRMS() const { return std::sqrt(meanSquare); }
+  };
+
+  // Works through the whole of data, which has to be complete
+  explicit WaveformPyramid(const SampleData &data, int baseBlockSize = 64)
+      : blockSize(baseBlockSize), numSamples(data.getNumSamples()) {
+    const int numChannels = data.getNumChannels();
+    const int blocksPerChunk = 1024;
+    std::vector<float> chunk((size_t)(blockSize * blocksPerChunk));
+
+    levels.resize((size_t)numChannels);
+    for (int channel = 0; channel < numChannels; ++channel) {
+      auto &channelLevels = levels[(size_t)channel];
+      channelLevels.emplace_back();
+      auto &base = channelLevels.back();
+      base.reserve((size_t)((numSamples + blockSize - 1) / blockSize));
+
+      for (int start = 0; start < numSamples; start += (int)chunk.size()) {
+        const auto num = juce::jmin((int)chunk.size(), numSamples - start);
+        data.read(channel, start, chunk.data(), num);
+        for (int offset = 0; offset < num; offset += blockSize) {
+          base.push_back(summarise(chunk.data() + offset,
+                                   juce::jmin(blockSize, num - offset)));
+        }
+      }
+
+      while (channelLevels.back().size() > 1) {
+        const auto &below = channelLevels.back();
+        const auto level = channelLevels.size() - 1;
+        std::vector<Bin> above((below.size() + 1) / 2);
+        for (size_t i = 0; i < above.size(); ++i) {
+          above[i] = below[2 * i];
+          if (2 * i + 1 < below.size()) {
+            merge(above[i], getLength(level, 2 * i), below[2 * i + 1],
+                  getLength(level, 2 * i + 1));
+          }
+        }
+        channelLevels.push_back(std::move(above));
+      }
+    }
+  }
+
+  // Everything in [startSample, startSample + num) of channel. The level 0
+  // blocks at either end count whole, so it can take in up to
+  // baseBlockSize - 1 samples either side
+  Bin getRange(int channel, juce::int64 startSample, juce::int64 num) const {
+    if (channel < 0 || channel >= getNumChannels() || startSample < 0 ||
+        startSample >= numSamples || num <= 0) {
+      return {};
+    }
+
+    num = juce::jmin(num, (juce::int64)numSamples - startSample);
+    const auto &channelLevels = levels[(size_t)channel];
+
+    // Climb the levels, taking the odd bin off either end on the way up
+    auto from = (size_t)(startSample / blockSize);
+    auto to = (size_t)((startSample + num - 1) / blockSize) + 1;
+    Bin result;
+    juce::int64 length = 0;
+    for (size_t level = 0; from < to; ++level, from /= 2, to /= 2) {
+      if (from % 2 == 1) {
+        take(result, length, channelLevels[level], level, from++);
+      }
+      if (to % 2 == 1) {
+        take(result, length, channelLevels[level], level, --to);
+      }
+    }
+    return result;
+  }
+
+  // One bin for each of numPixels slices of [startSample, startSample + num)
+  void getPixels(int channel, juce::int64 startSample, juce::int64 num,
+                 Bin *pixels, int numPixels) const {
+    for (int pixel = 0; pixel < numPixels; ++pixel) {
+      const auto from = startSample + num * pixel / numPixels;
+      const auto to = startSample + num * (pixel + 1) / numPixels;
+      pixels[pixel] =
+          getRange(channel, from, juce::jmax<juce::int64>(1, to - from));
+    }
+  }
+
+  int getNumChannels() const { return (int)levels.size(); }
+  int getNumSamples() const { return numSamples; }
+  int getBaseBlockSize() const { return blockSize; }
+  int getNumLevels() const {
+    return levels.empty() ? 0 : (int)levels.front().size();
+  }
+
+  // Every level of every channel, for the disk cache
+  void writeTo(detail::ByteWriter &out) const {
+    out.write((juce::int32)blockSize);
+    out.write((juce::int32)numSamples);
+    out.write((juce::int32)levels.size());
+    for (const auto &channelLevels : levels)
+      for (const auto &bins : channelLevels)
+        out.write(bins.data(), bins.size());
+  }
+
+  // What writeTo() wrote, or nullptr if it doesn't hold together. Only for
+  // sounds with samples, so every channel's bins can be checked for before
+  // any room is made for them
+  static std::unique_ptr<WaveformPyramid> readFrom(detail::ByteReader &in) {
+    juce::int32 blockSize = 0, numSamples = 0, numChannels = 0;
+    if (!in.read(blockSize) || !in.read(numSamples) || !in.read(numChannels) ||
+        blockSize <= 0 || numSamples <= 0 || numChannels < 0 ||
+        !in.hasRoomFor<Bin>((size_t)numChannels *
+                            (size_t)(((juce::int64)numSamples + blockSize - 1) /
+                                     blockSize))) {
+      return nullptr;
+    }
+
+    std::unique_ptr<WaveformPyramid> pyramid(
+        new WaveformPyramid(blockSize, numSamples));
+    pyramid->levels.resize((size_t)numChannels);
+    for (auto &channelLevels : pyramid->levels) {
+      // The level sizes follow from the length, just as they're built
+      auto size =
+          (size_t)(((juce::int64)numSamples + blockSize - 1) / blockSize);
+      do {
+        if (!in.hasRoomFor<Bin>(size)) {
+          return nullptr;
+        }
+
+        channelLevels.emplace_back(size);
+        in.read(channelLevels.back().data(), size);
+        size = (size + 1) / 2;
+      } while (channelLevels.back().size() > 1);
+    }
+
+    return pyramid;
+  }
+
+private:
+  WaveformPyramid(int baseBlockSize, int length)
+      : blockSize(baseBlockSize), numSamples(length) {}
+
+  static Bin summarise(const float *samples, int num) {
+    const auto range =
+        juce::FloatVectorOperations::findMinAndMax(samples, num);
+
+    // Summed across lanes so the compiler can vectorise it
+    constexpr int lanes = 8;
+    std::array<float, lanes> sums{};
+    int i = 0;
+    for (; i + lanes <= num; i += lanes)
+      for (int lane = 0; lane < lanes; ++lane)
+        sums[(size_t)lane] += samples[i + lane] * samples[i + lane];
+    for (; i < num; ++i)
+      sums[0] += samples[i] * samples[i];
+
+    const auto sum = std::accumulate(sums.begin(), sums.end(), 0.0f);
+    return {range.getStart(), range.getEnd(), sum / (float)num};
+  }
+
+  // Fold b, covering lengthB samples, into a, covering lengthA
+  static void merge(Bin &a, juce::int64 lengthA, const Bin &b,
+                    juce::int64 lengthB) {
+    a.min = juce::jmin(a.min, b.min);
+    a.max = juce::jmax(a.max, b.max);
+    a.meanSquare = (float)(((double)a.meanSquare * (double)lengthA +
+                            (double)b.meanSquare * (double)lengthB) /
+                           (double)(lengthA + lengthB));
+  }
+
+  void take(Bin &result, juce::int64 &length, const std::vector<Bin> &bins,
+            size_t level, size_t index) const {
+    const auto binLength = getLength(level, index);
+    if (length == 0) {
+      result = bins[index];
+    } else {
+      merge(result, length, bins[index], binLength);
+    }
+    length += binLength;
+  }
+
+  // How many samples bin index of level covers; the last is usually short
+  juce::int64 getLength(size_t level, size_t index) const {
+    const auto full = (juce::int64)blockSize << level;
+    return juce::jmin(full,
+                      (juce::int64)numSamples - (juce::int64)index * full);
+  }
+
+  int blockSize;
+  int numSamples;
+  std::vector<std::vector<std::vector<Bin>>> levels;
+};
+
+// Decoded samples kept in memory up to a byte budget, least recently used out
+// first. Keyed on a file's path, size and modification time and the sample
+// rate and storage it was decoded for, so edited files miss.
+//
+// Only the loader's threads should use it, which keeps eviction, and the
+// deallocation that goes with it, off the audio thread. Data evicted while a
+// sound still holds it is freed when that sound is, so hand sounds back
+// through Loader::destroy().
+class SampleCache {
+public:
+  struct Key {
+    static Key forFile(const juce::File &file, double sampleRate,
+                       bool compact = false) {
+      return {file.getFullPathName(), file.getSize(),
+              file.getLastModificationTime().toMilliseconds(), sampleRate,
+              compact};
+    }
+
+    bool operator==(const Key &other) const {
+      return size == other.size && modified == other.modified &&
+             sampleRate == other.sampleRate && compact == other.compact &&
+             path == other.path;
+    }
+
+    juce::String path;
+    juce::int64 size = 0;
+    juce::int64 modified = 0;
+    double sampleRate = 0.0;
+    bool compact = false;
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key &key) const {
+      return (size_t)key.path.hashCode64() ^ (size_t)key.size ^
+             ((size_t)key.modified << 1) ^
+             std::hash<double>()(key.sampleRate);
+    }
+  };
+
+  explicit SampleCache(size_t budgetInBytes = 256 * 1024 * 1024)
+      : budget(budgetInBytes) {}
+
+  // The cached data for key, or nullptr. A hit makes it the most recently
+  // used
+  SampleData::Ptr find(const Key &key) {
+    const juce::ScopedLock sl(lock);
+    const auto it = index.find(key);
+    if (it == index.end()) {
+      ++misses;
+      return nullptr;
+    }
+
+    ++hits;
+    entries.splice(entries.begin(), entries, it->second);
+    return it->second->data;
+  }
+
+  // Add data as the most recently used, then evict down to the budget
+  void insert(const Key &key, SampleData::Ptr data) {
+    std::vector<SampleData::Ptr> evicted;
+    {
+      const juce::ScopedLock sl(lock);
+      if (const auto it = index.find(key); it != index.end())
+        erase(it->second, evicted);
+
+      numBytes += data->getNumBytes();
+      entries.push_front({key, std::move(data)});
+      index[key] = entries.begin();
+      evictOverBudget(evicted);
+    }
+    // evicted goes out of scope here, outside the lock
+  }
+
+  void setBudget(size_t budgetInBytes) {
+    std::vector<SampleData::Ptr> evicted;
+    const juce::ScopedLock sl(lock);
+    budget = budgetInBytes;
+    evictOverBudget(evicted);
+  }
+
+  size_t getBudget() const {
+    const juce::ScopedLock sl(lock);
+    return budget;
+  }
+
+  size_t getNumBytes() const {
+    const juce::ScopedLock sl(lock);
+    return numBytes;
+  }
+
+  size_t getNumEntries() const {
+    const juce::ScopedLock sl(lock);
+    return entries.size();
+  }
+
+  size_t getNumHits() const { return hits.load(); }
+  size_t getNumMisses() const { return misses.load(); }
+
+private:
+  struct Entry {
+    Key key;
+    SampleData::Ptr data;
+  };
+
+  using Entries = std::list<Entry>;
+
+  void erase(Entries::iterator it,
+             std::vector<SampleData::Ptr> &evicted) {
+    numBytes -= it->data->getNumBytes();
+    evicted.push_back(std::move(it->data));
+    index.erase(it->key);
+    entries.erase(it);
+  }
+
+  void evictOverBudget(std::vector<SampleData::Ptr> &evicted) {
+    while (numBytes > budget && !entries.empty())
+      erase(std::prev(entries.end()), evicted);
+  }
+
+  juce::CriticalSection lock;
+  size_t budget;
+  size_t numBytes = 0;
+  Entries entries;
+  std::unordered_map<Key, Entries::iterator, KeyHash> index;
+  std::atomic<size_t> hits{0}, misses{0};
+};
+
+// Every fully decoded SampleData alive in the process, keyed like a
+// SampleCache, so any number of plugin instances loading the same file
+// share one copy of it whatever their own caches hold. Only weak
+// references are kept, so data goes when the last sound or cache holding it
+// does, and Loader::destroy() keeps that on a loader thread. For the
+// loader's threads only, like SampleCache.
+class SamplePool {
+public:
+  static SamplePool &getInstance() {
+    static SamplePool instance;
+    return instance;
+  }
+
+  // The live data for key, or nullptr
+  SampleData::Ptr find(const SampleCache::Key &key) {
+    const juce::ScopedLock sl(lock);
+    const auto it = index.find(key);
+    return it != index.end() ? it->second.lock() : nullptr;
+  }
+
+  // Share data under key. If another copy got there first and is still
+  // alive, that comes back instead, and data can be dropped
+  SampleData::Ptr insert(const SampleCache::Key &key, SampleData::Ptr data) {
+    const juce::ScopedLock sl(lock);
+    auto &entry = index[key];
+    if (auto existing = entry.lock())
+      return existing;
+
+    entry = data;
+
+    // Forget dead entries now and then rather than on every release
+    if (++insertsSincePrune >= pruneInterval) {
+      insertsSincePrune = 0;
+      for (auto it = index.begin(); it != index.end();)
+        it = it->second.expired() ? index.erase(it) : std::next(it);
+    }
+
+    return data;
+  }
+
+  size_t getNumEntries() {
+    const juce::ScopedLock sl(lock);
+    return index.size();
+  }
+
+private:
+  static constexpr int pruneInterval = 64;
+
+  SamplePool() = default;
+
+  juce::CriticalSection lock;
+  std::unordered_map<SampleCache::Key, std::weak_ptr<const SampleData>,
+                     SampleCache::KeyHash>
+      index;
+  int insertsSincePrune = 0;
+};
+
+// Decoded samples kept on disk between sessions, so a file is only decoded
+// the first time it's loaded and mapped straight back in after that. Each
+// entry is a 128-byte header saying what it was decoded from, then the
+// samples in the layout SampleData uses, one channel after another, then
+// their WaveformPyramid and SampleAnalysis, so they aren't worked out again
+// either. The load() and store() bodies follow SampleAnalysis. A file
+// whose source has changed since is treated as missing and written over.
+// Loader threads only; entries are written whole and then renamed into
+// place, so instances sharing a directory never see half of one.
+//
+// The directory is held to a byte budget, least recently used entries out
+// first. It's pruned once per process, by the first store() to it, so on a
+// loader thread rather than whichever thread opened the cache, and however
+// many instances open it. Hits are touched, so that's the order their files
+// were last written in. Entries still mapped by another
+// instance go on working after they're deleted, except on Windows, where
+// they aren't deleted until next time.
+class DiskSampleCache {
+public:
+  static constexpr juce::int64 defaultMaxBytes = (juce::int64)1 << 30;
+
+  explicit DiskSampleCache(juce::File cacheDirectory,
+                           juce::int64 maxBytes = defaultMaxBytes)
+      : directory(std::move(cacheDirectory)), budget(maxBytes) {}
+
+  // The stored data for key, mapped from disk and already complete, or
+  // nullptr
+  std::shared_ptr<SampleData> load(const SampleCache::Key &key) const;
+
+  // Write complete data for key, overview and analysis included. Returns
+  // false if it couldn't, which only means decoding it again next time
+  bool store(const SampleCache::Key &key, const SampleData &data) const;
+
+  // Whether there's an entry for key that's still current, going by its
+  // header alone
+  bool contains(const SampleCache::Key &key) const;
+
+  const juce::File &getDirectory() const { return directory; }
+  juce::int64 getMaxBytes() const { return budget; }
+
+  // Delete the least recently used entries until the rest fit the budget.
+  // Entries stored since count next time. Lists the whole directory, so
+  // keep it off the message and audio threads
+  void prune() const {
+    auto files =
+        directory.findChildFiles(juce::File::findFiles, false, "*.samples");
+    std::sort(files.begin(), files.end(),
+              [](const juce::File &a, const juce::File &b) {
+                return a.getLastModificationTime() >
+                       b.getLastModificationTime();
+              });
+
+    juce::int64 total = 0;
+    for (const auto &file : files) {
+      total += file.getSize();
+      if (total > budget) {
+        file.deleteFile();
+      }
+    }
+  }
+
+private:
+  // prune() the first time this process gets here for the directory
+  void pruneOnce() const {
+    static juce::CriticalSection lock;
+    static std::vector<juce::File> pruned;
+    {
+      const juce::ScopedLock sl(lock);
+      if (std::find(pruned.begin(), pruned.end(), directory) != pruned.end()) {
+        return;
+      }
+      pruned.push_back(directory);
+    }
+
+    prune();
+  }
+
+  // Padded out to dataOffset on disk, so the samples start aligned
+  struct Header {
+    char magic[4];
+    juce::uint32 version;
+    juce::int64 sourceSize;
+    juce::int64 sourceModified;
+    juce::int64 pathHash;
+    double requestedRate;
+    double sampleRate;
+    juce::int32 numChannels;
+    juce::int32 numSamples;
+    juce::int32 storage;
+    juce::int32 compact;
+    juce::int64 summaryBytes;
+  };
+
+  static constexpr size_t dataOffset = 128;
+  static_assert(sizeof(Header) <= dataOffset);
+
+  static Header headerFor(const SampleCache::Key &key) {
+    Header header{};
+    std::memcpy(header.magic, "MHSC", sizeof(header.magic));
+    header.version = 2;
+    header.sourceSize = key.size;
+    header.sourceModified = key.modified;
+    header.pathHash = key.path.hashCode64();
+    header.requestedRate = key.sampleRate;
+    header.compact = key.compact ? 1 : 0;
+    return header;
+  }
+
+  // Whether a stored header was written for the same file and request
+  static bool matches(const Header &header, const Header &expected) {
+    return std::memcmp(header.magic, expected.magic, sizeof(header.magic)) ==
+               0 &&
+           header.version == expected.version &&
+           header.sourceSize == expected.sourceSize &&
+           header.sourceModified == expected.sourceModified &&
+           header.pathHash == expected.pathHash &&
+           header.requestedRate == expected.requestedRate &&
+           header.compact == expected.compact;
+  }
+
+  // Leaves the source's size and time out, so a changed file's entry is
+  // written over rather than left behind
+  juce::File fileFor(const SampleCache::Key &key) const {
+    const auto name = key.path + "|" + juce::String(key.sampleRate) + "|" +
+                      juce::String(key.compact ? 1 : 0);
+    return directory.getChildFile(
+        juce::String::toHexString(name.hashCode64()) + ".samples");
+  }
+
+  juce::File directory;
+  juce::int64 budget;
+};
+
+namespace detail {
+// Windowed-sinc sample rate conversion by a fixed ratio, for load time. The
+// rates are taken to the nearest Hz and reduced to up/down, and the filter
+// is worked out once for each of the up fractional positions an output
+// sample can land on, or the nearest of maxPhases when there are more. Each
+// output sample is then one dot product, summed across lanes so the
+// compiler turns it into vector code without needing -ffast-math.
+class PolyphaseResampler {
+public:
+  PolyphaseResampler(double sourceRate, double targetRate) {
+    const auto from = (juce::int64)std::llround(sourceRate);
+    const auto to = (juce::int64)std::llround(targetRate);
+    const auto divisor = std::gcd(from, to);
+    down = from / divisor;
+    up = to / divisor;
+    numPhases = (int)juce::jmin(up, (juce::int64)maxPhases);
+
+    // Cut off just below whichever Nyquist frequency is lower, and widen
+    // the filter by as much as that is below the source's
+    const auto cutoff =
+        rolloff * juce::jmin(1.0, (double)up / (double)down);
+    numTaps = (int)std::ceil(2.0 * zeroCrossings / cutoff);
+    numTaps = (numTaps + lanes - 1) / lanes * lanes;
+
+    const auto halfWidth = numTaps / 2.0;
+    coefficients.resize((size_t)(numPhases * numTaps));
+    for (int phase = 0; phase < numPhases; ++phase) {
+      auto *taps = &coefficients[(size_t)(phase * numTaps)];
+      const auto fraction = (double)phase / numPhases;
+
+      double sum = 0.0;
+      for (int tap = 0; tap < numTaps; ++tap) {
+        const auto distance = tap - numTaps / 2 + 1 - fraction;
+        const auto value =
+            sinc(cutoff * distance) * kaiser(distance / halfWidth);
+        taps[tap] = (float)value;
+        sum += value;
+      }
+
+      // Unity gain at DC for every phase
+      for (int tap = 0; tap < numTaps; ++tap)
+        taps[tap] = (float)(taps[tap] / sum);
+    }
+  }
+
+  int getNumOutputSamples(int numInputSamples) const {
+    return (int)((juce::int64)numInputSamples * up / down);
+  }
+
+  // How many input samples go into each output sample
+  int getNumTaps() const { return numTaps; }
+
+  void process(const float *input, int numInputSamples, float *output,
+               int numOutputSamples) {
+    const int before = numTaps / 2 - 1;
+    padded.assign((size_t)(numInputSamples + numTaps), 0.0f);
+    std::copy(input, input + numInputSamples, padded.begin() + before);
+
+    for (int i = 0; i < numOutputSamples; ++i) {
+      const auto position = (juce::int64)i * down;
+      const auto phase = (position % up) * numPhases / up;
+      output[i] = dot(&coefficients[(size_t)(phase * numTaps)],
+                      &padded[(size_t)(position / up)]);
+    }
+  }
+
+private:
+  static constexpr int maxPhases = 4096;
+  static constexpr int lanes = 8;
+  static constexpr double zeroCrossings = 64.0;
+  static constexpr double rolloff = 0.94;
+  static constexpr double kaiserBeta = 10.0;
+
+  float dot(const float *taps, const float *samples) const {
+    std::array<float, lanes> sums{};
+    for (int tap = 0; tap < numTaps; tap += lanes)
+      for (int lane = 0; lane < lanes; ++lane)
+        sums[(size_t)lane] += taps[tap + lane] * samples[tap + lane];
+
+    return std::accumulate(sums.begin(), sums.end(), 0.0f);
+  }
+
+  static double sinc(double x) {
+    if (x == 0.0)
+      return 1.0;
+    const auto angle = juce::MathConstants<double>::pi * x;
+    return std::sin(angle) / angle;
+  }
+
+  // x runs from -1 to 1 across the filter
+  static double kaiser(double x) {
+    if (std::abs(x) >= 1.0)
+      return 0.0;
+    return besselI0(kaiserBeta * std::sqrt(1.0 - x * x)) /
+           besselI0(kaiserBeta);
+  }
+
+  static double besselI0(double x) {
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 32; ++k) {
+      const auto half = x / (2.0 * k);
+      term *= half * half;
+      sum += term;
+    }
+    return sum;
+  }
+
+  juce::int64 up = 1, down = 1;
+  int numPhases = 1, numTaps = lanes;
+  std::vector<float> coefficients;
+  std::vector<float> padded;
+};
+} // namespace detail
+
+// What can be worked out about a sound once all of it is decoded, so the
+// audio thread never has to: sample and true peak, integrated loudness,
+// where it starts and stops being audible, and where its hits are.
+//
+// Loudness follows ITU-R BS.1770, K-weighted and gated over 400 ms blocks,
+// except that anything shorter than one block, like most drum hits, is
+// measured as a single block. True peak is taken at four times the sample
+// rate. Onsets are where the level over 5 ms frames jumps by onsetRiseDb.
+class SampleAnalysis {
+public:
+  static constexpr double silenceThresholdDb = -60.0;
+  static constexpr double onsetRiseDb = 9.0;
+  static constexpr double minOnsetGapSeconds = 0.05;
+
+  // Works through the whole of data, which has to be complete
+  explicit SampleAnalysis(const SampleData &data) {
+    const int numChannels = data.getNumChannels();
+    const int numSamples = data.getNumSamples();
+    if (numChannels == 0 || numSamples == 0) {
+      return;
+    }
+
+    const double rate = data.sampleRate > 0.0 ? data.sampleRate : 48000.0;
+    const int step = juce::jmax(1, (int)std::lround(rate * 0.1));
+    const int hop = juce::jmax(1, (int)std::lround(rate * 0.005));
+    const auto threshold =
+        (float)juce::Decibels::decibelsToGain(silenceThresholdDb);
+
+    std::vector<double> stepEnergy((size_t)((numSamples + step - 1) / step));
+    std::vector<double> frameEnergy((size_t)((numSamples + hop - 1) / hop));
+    std::vector<float> chunk((size_t)chunkSize);
+    int firstAudible = numSamples, lastAudible = -1;
+
+    for (int channel = 0; channel < numChannels; ++channel) {
+      auto filters = makeKWeighting(rate);
+
+      for (int start = 0; start < numSamples; start += chunkSize) {
+        const auto num = juce::jmin(chunkSize, numSamples - start);
+        data.read(channel, start, chunk.data(), num);
+
+        for (int i = 0; i < num; ++i) {
+          const auto sample = chunk[(size_t)i];
+          const auto index = start + i;
+          const auto magnitude = std::abs(sample);
+          peak = juce::jmax(peak, magnitude);
+          if (magnitude > threshold) {
+            firstAudible = juce::jmin(firstAudible, index);
+            lastAudible = index;
+          }
+
+          const auto weighted = filters[1].process(filters[0].process(sample));
+          stepEnergy[(size_t)(index / step)] += weighted * weighted;
+          frameEnergy[(size_t)(index / hop)] += (double)sample * sample;
+        }
+      }
+
+      truePeak = juce::jmax(truePeak, findTruePeak(data, channel, rate));
+    }
+
+    if (lastAudible >= 0) {
+      soundStart = firstAudible;
+      soundEnd = lastAudible + 1;
+    }
+
+    integratedLoudness = gate(stepEnergy, step, numSamples);
+    findOnsets(frameEnergy, hop, numChannels, rate);
+  }
+
+  // Linear, the largest sample
+  float getPeak() const { return peak; }
+  // Linear, the largest value between samples too
+  float getTruePeak() const { return truePeak; }
+  // LUFS, or -infinity if it's all below the absolute gate
+  double getIntegratedLoudness() const { return integratedLoudness; }
+
+  // The first sample above silenceThresholdDb in any channel, and one past
+  // the last. Both 0 if there are none
+  int getSoundStart() const { return soundStart; }
+  int getSoundEnd() const { return soundEnd; }
+
+  // Sample positions, to within 5 ms
+  const std::vector<int> &getOnsets() const { return onsets; }
+
+  // Everything above, for the disk cache
+  void writeTo(detail::ByteWriter &out) const {
+    out.write(peak);
+    out.write(truePeak);
+    out.write(integratedLoudness);
+    out.write((juce::int32)soundStart);
+    out.write((juce::int32)soundEnd);
+    out.write((juce::int32)onsets.size());
+    out.write(onsets.data(), onsets.size());
+  }
+
+  // What writeTo() wrote, or nullptr if it's cut short
+  static std::unique_ptr<SampleAnalysis> readFrom(detail::ByteReader &in) {
+    std::unique_ptr<SampleAnalysis> analysis(new SampleAnalysis);
+    juce::int32 start = 0, end = 0, numOnsets = 0;
+    if (!in.read(analysis->peak) || !in.read(analysis->truePeak) ||
+        !in.read(analysis->integratedLoudness) || !in.read(start) ||
+        !in.read(end) || !in.read(numOnsets) || numOnsets < 0 ||
+        !in.hasRoomFor<int>((size_t)numOnsets)) {
+      return nullptr;
+    }
+
+    analysis->soundStart = start;
+    analysis->soundEnd = end;
+    analysis->onsets.resize((size_t)numOnsets);
+    in.read(analysis->onsets.data(), analysis->onsets.size());
+
+    return analysis;
+  }
+
+  // The gain that brings the sound to targetLoudness LUFS, held down so its
+  // true peak stays under truePeakCeiling dBTP
+  float getNormalisationGain(double targetLoudness = -23.0,
+                             double truePeakCeiling = -1.0) const {
+    if (!std::isfinite(integratedLoudness) || truePeak <= 0.0f) {
+      return 1.0f;
+    }
+
+    const auto headroom =
+        truePeakCeiling - juce::Decibels::gainToDecibels((double)truePeak);
+    return (float)juce::Decibels::decibelsToGain(
+        juce::jmin(targetLoudness - integratedLoudness, headroom));
+  }
+
+private:
+  static constexpr int chunkSize = 1 << 16;
+  static constexpr int oversampling = 4;
+
+  SampleAnalysis() = default;
+
+  struct Biquad {
+    double process(double x) {
+      const auto y = b0 * x + z1;
+      z1 = b1 * x - a1 * y + z2;
+      z2 = b2 * x - a2 * y;
+      return y;
+    }
+
+    double b0, b1, b2, a1, a2;
+    double z1 = 0.0, z2 = 0.0;
+  };
+
+  // BS.1770's high shelf then high pass, for any sample rate
+  static std::array<Biquad, 2> makeKWeighting(double rate) {
+    const auto pi = juce::MathConstants<double>::pi;
+
+    auto k = std::tan(pi * 1681.974450955533 / rate);
+    auto q = 0.7071752369554196;
+    const auto vh = std::pow(10.0, 3.999843853973347 / 20.0);
+    const auto vb = std::pow(vh, 0.4996667741545416);
+    auto a0 = 1.0 + k / q + k * k;
+    const Biquad shelf{(vh + vb * k / q + k * k) / a0, 2.0 * (k * k - vh) / a0,
+                       (vh - vb * k / q + k * k) / a0,
+                       2.0 * (k * k - 1.0) / a0, (1.0 - k / q + k * k) / a0};
+
+    k = std::tan(pi * 38.13547087602444 / rate);
+    q = 0.5003270373238773;
+    a0 = 1.0 + k / q + k * k;
+    const Biquad highPass{1.0, -2.0, 1.0, 2.0 * (k * k - 1.0) / a0,
+                          (1.0 - k / q + k * k) / a0};
+
+    return {shelf, highPass};
+  }
+
+  static double loudnessOf(double meanSquare) {
+    return meanSquare > 0.0 ? -0.691 + 10.0 * std::log10(meanSquare)
+                            : -std::numeric_limits<double>::infinity();
+  }
+
+  // Absolute then relative gating over blocks of four steps, stepping one
+  // at a time. stepEnergy is already summed over the channels
+  static double gate(const std::vector<double> &stepEnergy, int step,
+                     int numSamples) {
+    constexpr size_t stepsPerBlock = 4;
+    constexpr double absoluteGate = -70.0;
+    const auto numFullSteps = (size_t)(numSamples / step);
+
+    if (numFullSteps < stepsPerBlock) {
+      const auto total =
+          std::accumulate(stepEnergy.begin(), stepEnergy.end(), 0.0);
+      const auto loudness = loudnessOf(total / numSamples);
+      return loudness > absoluteGate
+                 ? loudness
+                 : -std::numeric_limits<double>::infinity();
+    }
+
+    std::vector<double> blocks;
+    for (size_t i = 0; i + stepsPerBlock <= numFullSteps; ++i) {
+      const auto first = stepEnergy.begin() + (std::ptrdiff_t)i;
+      const auto meanSquare =
+          std::accumulate(first, first + stepsPerBlock, 0.0) /
+          (double)(stepsPerBlock * (size_t)step);
+      if (loudnessOf(meanSquare) > absoluteGate)
+        blocks.push_back(meanSquare);
+    }
+
+    if (blocks.empty()) {
+      return -std::numeric_limits<double>::infinity();
+    }
+
+    const auto relativeGate =
+        loudnessOf(std::accumulate(blocks.begin(), blocks.end(), 0.0) /
+                   (double)blocks.size()) -
+        10.0;
+
+    double sum = 0.0;
+    size_t count = 0;
+    for (const auto meanSquare : blocks) {
+      if (loudnessOf(meanSquare) > relativeGate) {
+        sum += meanSquare;
+        ++count;
+      }
+    }
+
+    return count > 0 ? loudnessOf(sum / (double)count)
+                     : -std::numeric_limits<double>::infinity();
+  }
+
+  // Oversampled a chunk at a time, each read with enough either side that
+  // the filter never sees a false edge
+  static float findTruePeak(const SampleData &data, int channel,
+                            double rate) {
+    detail::PolyphaseResampler oversampler(rate, rate * oversampling);
+    const int numSamples = data.getNumSamples();
+    const int context = oversampler.getNumTaps();
+    std::vector<float> input, output;
+    float result = 0.0f;
+
+    for (int start = 0; start < numSamples; start += chunkSize) {
+      const auto num = juce::jmin(chunkSize, numSamples - start);
+      const auto from = juce::jmax(0, start - context);
+      const auto to = juce::jmin(numSamples, start + num + context);
+
+      input.resize((size_t)(to - from));
+      data.read(channel, from, input.data(), to - from);
+      output.resize((size_t)oversampler.getNumOutputSamples(to - from));
+      oversampler.process(input.data(), to - from, output.data(),
+                          (int)output.size());
+
+      const auto first = (size_t)((start - from) * oversampling);
+      const auto last =
+          juce::jmin(output.size(), first + (size_t)(num * oversampling));
+      for (auto i = first; i < last; ++i)
+        result = juce::jmax(result, std::abs(output[i]));
+    }
+
+    return result;
+  }
+
+  // Picks frames whose level rises furthest, past onsetRiseDb, above
+  // silence and at least minOnsetGapSeconds after the last
+  void findOnsets(const std::vector<double> &frameEnergy, int hop,
+                  int numChannels, double rate) {
+    std::vector<double> levels;
+    for (const auto energy : frameEnergy) {
+      levels.push_back(
+          10.0 * std::log10(energy / ((double)hop * numChannels) + 1e-12));
+    }
+
+    const auto riseAt = [&](size_t i) {
+      return i == 0 ? levels[0] + 120.0 : levels[i] - levels[i - 1];
+    };
+
+    const auto minGap =
+        juce::jmax(1, (int)std::lround(minOnsetGapSeconds * rate / hop));
+    int lastOnset = -minGap;
+    for (size_t i = 0; i < levels.size(); ++i) {
+      const auto rise = riseAt(i);
+      const bool isPeak = (i == 0 || rise >= riseAt(i - 1)) &&
+                          (i + 1 == levels.size() || rise > riseAt(i + 1));
+      if (rise >= onsetRiseDb && isPeak && levels[i] > silenceThresholdDb &&
+          (int)i - lastOnset >= minGap) {
+        onsets.push_back((int)i * hop);
+        lastOnset = (int)i;
+      }
+    }
+  }
+
+  float peak = 0.0f;
+  float truePeak = 0.0f;
+  double integratedLoudness = -std::numeric_limits<double>::infinity();
+  int soundStart = 0;
+  int soundEnd = 0;
+  std::vector<int> onsets;
+};
+
+inline void SampleData::complete() {
+  complete(std::make_unique<WaveformPyramid>(*this),
+           std::make_unique<SampleAnalysis>(*this));
+}
+
+inline void
+SampleData::complete(std::unique_ptr<WaveformPyramid> storedOverview,
+                     std::unique_ptr<SampleAnalysis> storedAnalysis) {
+  overviewStorage = std::move(storedOverview);
+  overview.store(overviewStorage.get(), std::memory_order_release);
+  analysisStorage = std::move(storedAnalysis);
+  analysis.store(analysisStorage.get(), std::memory_order_release);
+}
+
+inline std::shared_ptr<SampleData>
+DiskSampleCache::load(const SampleCache::Key &key) const {
+  const auto file = fileFor(key);
+  if (!file.existsAsFile()) {
+    return nullptr;
+  }
+
+  auto mapping = std::make_unique<juce::MemoryMappedFile>(
+      file, juce::MemoryMappedFile::readOnly);
+  if (mapping->getData() == nullptr || mapping->getSize() < dataOffset) {
+    return nullptr;
+  }
+
+  Header header;
+  std::memcpy(&header, mapping->getData(), sizeof(Header));
+  if (!matches(header, headerFor(key)) || header.storage < 0 ||
+      header.storage > (juce::int32)SampleData::Storage::int24 ||
+      header.numChannels <= 0 || header.numSamples <= 0 ||
+      header.summaryBytes < 0) {
+    return nullptr;
+  }
+
+  const auto storage = (SampleData::Storage)header.storage;
+  const auto numBytes = (size_t)header.numChannels *
+                        (size_t)header.numSamples *
+                        SampleData::getBytesPerSample(storage);
+  if (mapping->getSize() !=
+      dataOffset + numBytes + (size_t)header.summaryBytes) {
+    return nullptr;
+  }
+
+  const auto *start =
+      static_cast<const char *>(mapping->getData()) + dataOffset;
+  detail::ByteReader summary(start + numBytes, (size_t)header.summaryBytes);
+  auto overview = WaveformPyramid::readFrom(summary);
+  auto analysis = SampleAnalysis::readFrom(summary);
+  if (overview == nullptr || analysis == nullptr || !summary.isExhausted() ||
+      overview->getNumChannels() != header.numChannels ||
+      overview->getNumSamples() != header.numSamples) {
+    return nullptr;
+  }
+
+  auto data = std::make_shared<SampleData>();
+  data->refer(std::move(mapping), start, storage, header.numChannels,
+              header.numSamples);
+  data->sampleRate = header.sampleRate;
+  data->complete(std::move(overview), std::move(analysis));
+
+  // Kept as recently used when it comes to pruning
+  file.setLastModificationTime(juce::Time::getCurrentTime());
+  return data;
+}
+
+inline bool DiskSampleCache::store(const SampleCache::Key &key,
+                                   const SampleData &data) const {
+  if (data.getNumSamples() == 0 || data.getOverview() == nullptr ||
+      data.getAnalysis() == nullptr || !directory.createDirectory().wasOk()) {
+    return false;
+  }
+
+  pruneOnce();
+
+  std::vector<char> summary;
+  detail::ByteWriter writer(summary);
+  data.getOverview()->writeTo(writer);
+  data.getAnalysis()->writeTo(writer);
+
+  auto header = headerFor(key);
+  header.sampleRate = data.sampleRate;
+  header.numChannels = data.getNumChannels();
+  header.numSamples = data.getNumSamples();
+  header.storage = (juce::int32)data.storage;
+  header.summaryBytes = (juce::int64)summary.size();
+
+  std::array<char, dataOffset> block{};
+  std::memcpy(block.data(), &header, sizeof(Header));
+
+  juce::TemporaryFile temp(fileFor(key));
+  {
+    juce::FileOutputStream out(temp.getFile());
+    if (!out.openedOk() || !out.write(block.data(), block.size()) ||
+        !out.write(data.getFirstSample(), data.getNumBytes()) ||
+        !out.write(summary.data(), summary.size())) {
+      return false;
+    }
+
+    out.flush();
+    if (out.getStatus().failed()) {
+      return false;
+    }
+  }
+
+  return temp.overwriteTargetFileWithTemporary();
+}
+
+inline bool DiskSampleCache::contains(const SampleCache::Key &key) const {
+  juce::FileInputStream in(fileFor(key));
+  Header header;
+  return in.openedOk() &&
+         in.read(&header, (int)sizeof(Header)) == (int)sizeof(Header) &&
+         matches(header, headerFor(key));
+}
+
+class LoadableSound {
+
+public:
+  struct Options {
+    juce::String name;
+    juce::File path;
+    juce::AudioFormatManager *formatManager = nullptr;
+
+    // Resample to this rate when decoding, or keep the file's rate if 0
+    double sampleRate = 0.0;
+
+    // Share decoded data through this cache, if there is one
+    std::shared_ptr<SampleCache> cache;
+
+    // Hand the sound over once this much of it is decoded and decode the
+    // rest in the background, or decode it all first if 0. Ignored when
+    // resampling
+    double progressiveMillis = 0.0;
+
+    // Keep integer files at their own width, 16 or 24 bits, rather than as
+    // floats. Takes half or three quarters of the memory, but the sound
+    // has to be read through getBlock() with a scratch block
+    bool compact = false;
+
+    // Keep decoded data on disk here too, and map it back from there
+    // rather than decoding next time, if there is one
+    std::shared_ptr<DiskSampleCache> diskCache;
+  };
+
+  // Decodes in chunks, and stops between them if the ticket is cancelled
+  LoadableSound(Options const &opts, const LoadTicket &ticket = {})
+      : name(opts.name) {
+    // Bail if the file doesn't exist
+    if (!opts.path.existsAsFile()) {
+      return;
+    }
+
+    const auto key =
+        SampleCache::Key::forFile(opts.path, opts.sampleRate, opts.compact);
+    if (opts.cache != nullptr) {
+      data = opts.cache->find(key);
+      if (data != nullptr) {
+        storeIfMissing(opts.diskCache, key);
+        return;
+      }
+    }
+
+    // Another instance may have it even if this one's cache doesn't, and
+    // an earlier session may have left it on disk
+    data = SamplePool::getInstance().find(key);
+    if (data == nullptr && opts.diskCache != nullptr) {
+      if (auto stored = opts.diskCache->load(key)) {
+        stored->lockPages();
+        data = SamplePool::getInstance().insert(key, std::move(stored));
+      }
+    }
+
+    if (data != nullptr) {
+      if (opts.cache != nullptr) {
+        opts.cache->insert(key, data);
+      }
+      storeIfMissing(opts.diskCache, key);
+      return;
+    }
+
+    auto reader = std::unique_ptr<juce::AudioFormatReader>(
+        opts.formatManager->createReaderFor(opts.path));
+
+    if (!reader) {
+      return;
+    }
+
+    const auto resampling =
+        opts.sampleRate > 0.0 && opts.sampleRate != reader->sampleRate;
+    const auto numSamples = (int)reader->lengthInSamples;
+    const auto head =
+        resampling ? numSamples
+                   : juce::jmin(numSamples,
+                                (int)(opts.progressiveMillis * 0.001 *
+                                      reader->sampleRate));
+
+    const auto storage = opts.compact ? compactStorageFor(*reader)
+                                      : SampleData::Storage::float32;
+
+    // Resampling works on floats, and packs them at the end
+    auto decoded = std::make_shared<SampleData>();
+    decoded->sampleRate = reader->sampleRate;
+    decoded->allocate(resampling ? SampleData::Storage::float32 : storage,
+                      (int)reader->numChannels, numSamples);
+
+    if (head > 0 && head < numSamples) {
+      if (!decode(*reader, *decoded, 0, head, ticket)) {
+        return;
+      }
+
+      decoded->lockPages();
+      data = decoded;
+      setRemainder({std::move(reader), std::move(decoded), head, ticket,
+                    opts.cache, opts.diskCache, key});
+      return;
+    }
 
-  Queue(size_t s = 1024) : size(s), queue(s) {}
+    if (!decode(*reader, *decoded, 0, numSamples, ticket)) {
+      return;
+    }
+
+    if (resampling) {
+      resample(*decoded, opts.sampleRate);
+      decoded->pack(storage);
+    }
 
-  const size_t getSize() const noexcept { return size; }
+    decoded->lockPages();
+    data = SamplePool::getInstance().insert(key, decoded);
+    if (opts.cache != nullptr) {
+      opts.cache->insert(key, data);
+    }
 
-  // Resize the queue, but deletes all existing data.
-  // Not thread safe!
-  void resize(int s) {
-    size = s;
-    queue = TypedQueue(s);
+    // Nothing left to decode, but the overview and analysis, and writing it
+    // out, can wait until the sound is playing. If the pool already had
+    // another copy, whoever made that one is seeing to them
+    if (data == decoded) {
+      setRemainder({nullptr, std::move(decoded), numSamples, ticket, nullptr,
+                    opts.diskCache, key});
+    }
   }
 
-  // Wipes out the queue and resets it to its initial state
-  // Not thread safe!
-  void clear() { queue = TypedQueue(queue.max_capacity()); }
+  // The work that's left once the sound has been handed over: the rest of a
+  // progressive load, and writing to the disk cache. The loader runs it a
+  // piece at a time after publishing the sound, each call returning whether
+  // there's more; it only holds on to the data, so the sound can be
+  // destroyed in the meantime
+  std::function<bool()> takeRemainder() { return std::move(remainder); }
 
-  // push an item into the queue
-  bool push(T const &item) { return queue.try_enqueue(item); }
+  // Data decoded here was locked as it was made, but data from the cache may
+  // have been paged out since, so read it back in
+  void makeResident() const {
+    if (data != nullptr && !data->pages)
+      ResidentMemory::touch(data->getFirstSample(), data->getNumBytes());
+  }
 
-  // push an item into the queue using move semantics
-  bool push(T &&item) { return queue.try_enqueue(item); }
+  const juce::String &getName() const { return name; }
 
-  // push an item into the queue using emplace semantics
-  template <typename... Args> bool emplace(Args &&...args) {
-    return queue.try_emplace(std::forward<Args>(args)...);
+  // The decoded audio, or nullptr if the file couldn't be read
+  const SampleData::Ptr &getData() const { return data; }
+
+  // For drawing the waveform, or nullptr until it's all decoded and the
+  // loader has got round to it
+  const WaveformPyramid *getOverview() const {
+    return data ? data->getOverview() : nullptr;
   }
 
-  // pop from the queue into item
-  bool pop(T &item) { return queue.try_dequeue(item); }
+  // Loudness, peaks, audible range and onsets, or nullptr until it's all
+  // decoded and the loader has got round to it
+  const SampleAnalysis *getAnalysis() const {
+    return data ? data->getAnalysis() : nullptr;
+  }
+
+  // A block of decoded audio, which comes back shorter than asked for, or
+  // empty, where a progressive load hasn't got to yet. Compact sounds have
+  // no floats to hand out, so they always come back empty here
+  juce::dsp::AudioBlock<const float> getBlock(size_t startSample,
+                                              size_t numSamples) const {
+    if (!clampToReady(startSample, numSamples)) {
+      return juce::dsp::AudioBlock<const float>();
+    }
 
-  // pop each item out of the queue and run a callback on it
-  void forEach(CallBack cbk) {
-    T item;
-    while (pop(item))
-      cbk(item);
+    jassert(data->storage == SampleData::Storage::float32);
+    if (data->storage != SampleData::Storage::float32) {
+      return juce::dsp::AudioBlock<const float>();
+    }
+
+    return juce::dsp::AudioBlock<const float>(
+        data->buffer.getArrayOfReadPointers(), getNumChannels(), startSample,
+        numSamples);
   }
 
-  // pop each item out of the queue, but only run the callback on the last one
-  void forLast(CallBack cbk) {
-    bool ran = false;
-    T item;
-    while (pop(item)) {
-      ran = true;
+  // The same for any sound, but compact ones are converted into scratch,
+  // which needs at least as many channels as the sound, and the block is
+  // cut short to fit it. Give each voice its own scratch
+  juce::dsp::AudioBlock<const float>
+  getBlock(size_t startSample, size_t numSamples,
+           juce::dsp::AudioBlock<float> scratch) const {
+    if (data == nullptr || data->storage == SampleData::Storage::float32) {
+      return getBlock(startSample, numSamples);
+    }
+
+    jassert(scratch.getNumChannels() >= getNumChannels());
+    numSamples = juce::jmin(numSamples, scratch.getNumSamples());
+    if (scratch.getNumChannels() < getNumChannels() ||
+        !clampToReady(startSample, numSamples)) {
+      return juce::dsp::AudioBlock<const float>();
+    }
+
+    for (size_t channel = 0; channel < getNumChannels(); ++channel) {
+      data->read((int)channel, (int)startSample,
+                 scratch.getChannelPointer(channel), (int)numSamples);
     }
 
-    if (ran)
-      cbk(item);
+    return scratch.getSubsetChannelBlock(0, getNumChannels())
+        .getSubBlock(0, numSamples);
   }
 
-  // return a reference to the underlying queue
-  TypedQueue &getQueue() const noexcept { return queue; }
+  size_t getNumChannels() const {
+    return data ? (size_t)data->getNumChannels() : 0;
+  }
+  size_t getNumSamples() const {
+    return data ? (size_t)data->getNumSamples() : 0;
+  }
+  // How far decoding has got; the same as getNumSamples() once it's done
+  size_t getNumSamplesReady() const {
+    return data ? (size_t)data->numSamplesReady.load(std::memory_order_acquire)
+                : 0;
+  }
+  double getSampleRate() const { return data ? data->sampleRate : 0.0; }
 
 private:
-  size_t size;
-  TypedQueue queue;
-};
+  // What's needed to finish without the sound. No reader if it's all
+  // decoded already
+  struct Remainder {
+    // How much is decoded per step, about six seconds at 44.1kHz
+    static constexpr int samplesPerStep = 1 << 18;
 
-template <typename T> class Ring {
-public:
-  using CallBack = std::function<void(T &)>;
-  using TypedQueue = moodycamel::BlockingReaderWriterCircularBuffer<T>;
+    // Decode the next piece, then analyse and share the data once it's all
+    // there, then write it to disk. Returns whether there's more to do
+    bool step() {
+      if (reader != nullptr) {
+        const auto end = juce::jmin(data->getNumSamples(),
+                                    start + samplesPerStep);
+        if (!decode(*reader, *data, start, end, ticket)) {
+          return false;
+        }
 
-  Ring(size_t s = 1024) : size(s), queue(s) {}
+        start = end;
+        if (start == data->getNumSamples()) {
+          reader.reset();
+        }
+        return true;
+      }
 
-  // Resize the queue, but deletes all existing data.
-  // Not thread safe!
-  void resize(int s) {
-    queue = TypedQueue(size);
-    size = s;
+      if (data->getAnalysis() == nullptr) {
+        data->complete();
+
+        // Shared once complete, unless it already is; if another copy beat
+        // it there, this sound keeps its own until it goes, and only the
+        // copy the pool kept goes to disk
+        auto shared = SamplePool::getInstance().insert(key, data);
+        if (shared != data) {
+          diskCache = nullptr;
+        }
+        if (cache != nullptr) {
+          cache->insert(key, std::move(shared));
+        }
+
+        return diskCache != nullptr;
+      }
+
+      if (diskCache != nullptr) {
+        diskCache->store(key, *data);
+      }
+      return false;
+    }
+
+    std::unique_ptr<juce::AudioFormatReader> reader;
+    std::shared_ptr<SampleData> data;
+    int start;
+    LoadTicket ticket;
+    std::shared_ptr<SampleCache> cache;
+    std::shared_ptr<DiskSampleCache> diskCache;
+    SampleCache::Key key;
+  };
+
+  // Remainder holds the reader, so it's shared to fit in a std::function
+  void setRemainder(Remainder &&r) {
+    remainder = [shared = std::make_shared<Remainder>(std::move(r))] {
+      return shared->step();
+    };
   }
 
-  const size_t getSize() const noexcept { return size; }
+  // Data that came from the caches may have been decoded by a load without
+  // a disk cache, such as a prefetch. If it's complete, and wasn't mapped
+  // from disk, write it out after publishing unless it's there already.
+  // Incomplete data goes to disk with whichever load is finishing it
+  void storeIfMissing(std::shared_ptr<DiskSampleCache> diskCache,
+                      const SampleCache::Key &key) {
+    if (diskCache == nullptr || data->getAnalysis() == nullptr ||
+        data->mapping != nullptr) {
+      return;
+    }
 
-  // Wipes out the queue and resets it to its initial state
-  // Not thread safe!
-  void clear() { queue = TypedQueue(queue.max_capacity()); }
+    remainder = [diskCache = std::move(diskCache), key, stored = data] {
+      if (!diskCache->contains(key)) {
+        diskCache->store(key, *stored);
+      }
+      return false;
+    };
+  }
 
-  // push an item into the queue
-  bool push(T const &item) { return queue.try_enqueue(item); }
+  // The narrowest storage that holds reader's samples without loss
+  static SampleData::Storage
+  compactStorageFor(const juce::AudioFormatReader &reader) {
+    if (reader.usesFloatingPointData || reader.bitsPerSample > 24) {
+      return SampleData::Storage::float32;
+    }
 
-  // push an item into the queue using move semantics
-  bool push(T &&item) { return queue.try_enqueue(item); }
+    return reader.bitsPerSample <= 16 ? SampleData::Storage::int16
+                                      : SampleData::Storage::int24;
+  }
 
-  // push an item into the queue using emplace semantics
-  template <typename... Args> bool emplace(Args &&...args) {
-    return queue.try_emplace(std::forward<Args>(args)...);
+  // Moves [startSample, startSample + numSamples) inside what's been
+  // decoded so far, returning false if none of it has
+  bool clampToReady(size_t &startSample, size_t &numSamples) const {
+    const auto numSamplesInBuffer = getNumSamples();
+
+    if (numSamplesInBuffer == 0) {
+      return false;
+    }
+
+    startSample = juce::jmin(startSample, numSamplesInBuffer - 1);
+
+    const auto numReady = getNumSamplesReady();
+    if (startSample >= numReady) {
+      return false;
+    }
+
+    numSamples = juce::jmin(numSamples, numReady - startSample);
+    return true;
   }
 
-  // pop from the queue into item
-  bool pop(T &item) { return queue.try_dequeue(item); }
+  // Read samples [start, end) in chunks, moving the watermark up after each
+  // one. Float data is read in place, and compact data through a float
+  // chunk. Returns false if the read failed or the ticket was cancelled
+  static bool decode(juce::AudioFormatReader &reader, SampleData &sample,
+                     int start, int end, const LoadTicket &ticket) {
+    constexpr int chunkSize = 1 << 16;
+    const int numChannels = sample.getNumChannels();
+    const bool inPlace = sample.storage == SampleData::Storage::float32;
+    juce::HeapBlock<float *> chunk((size_t)numChannels);
+    juce::AudioBuffer<float> floats(inPlace ? 0 : numChannels,
+                                    inPlace ? 0 : chunkSize);
+
+    for (; start < end; start += chunkSize) {
+      if (ticket.isCancelled()) {
+        return false;
+      }
+
+      for (int channel = 0; channel < numChannels; ++channel) {
+        chunk[(size_t)channel] =
+            inPlace ? sample.buffer.getWritePointer(channel, start)
+                    : floats.getWritePointer(channel);
+      }
+
+      const auto num = juce::jmin(chunkSize, end - start);
+      if (!reader.read(chunk.get(), numChannels, start, num)) {
+        return false;
+      }
 
-  // pop each item out of the queue and run a callback on it
-  void forEach(CallBack cbk) {
-    T item;
-    while (queue.try_dequeue(item))
-      cbk(item);
+      if (!inPlace) {
+        for (int channel = 0; channel < numChannels; ++channel) {
+          sample.write(channel, start, chunk[(size_t)channel], num);
+        }
+      }
+
+      sample.numSamplesReady.store(start + num, std::memory_order_release);
+    }
+
+    return true;
   }
 
-  // pop each item out of the queue, but only run the callback on the last one
-  void forLast(CallBack cbk) {
-    bool ran = false;
-    T item;
-    while (queue.try_dequeue(item)) {
-      ran = true;
+  static void resample(SampleData &sample, double targetRate) {
+    detail::PolyphaseResampler resampler(sample.sampleRate, targetRate);
+    const int numChannels = sample.getNumChannels();
+    const int numIn = sample.getNumSamples();
+    const int numOut = resampler.getNumOutputSamples(numIn);
+
+    const auto in = std::move(sample.buffer);
+    sample.allocate(SampleData::Storage::float32, numChannels, numOut);
+    for (int channel = 0; channel < numChannels; ++channel) {
+      resampler.process(in.getReadPointer(channel), numIn,
+                        sample.buffer.getWritePointer(channel), numOut);
     }
 
-    if (ran)
-      cbk(item);
+    sample.sampleRate = targetRate;
+    sample.numSamplesReady.store(numOut, std::memory_order_release);
   }
 
-  // return a reference to the underlying queue
-  TypedQueue &getQueue() const noexcept { return queue; }
+  juce::String name;
+  SampleData::Ptr data;
+  std::function<bool()> remainder;
+};
+
+namespace detail {
+class StreamState;
+}
+
+// The thread that refills every StreamingSound's read-ahead ring in the
+// process. Kept apart from the loader pools, so a long decode never makes a
+// stream run dry. Shared through juce::SharedResourcePointer, and only ever
+// woken by the streams themselves.
+class DiskStreamer : private juce::Thread, private juce::Thread::Listener {
+public:
+  DiskStreamer() : juce::Thread("DiskStreamer"), requests(1024) {
+    addListener(this);
+    startThread();
+  }
+
+  ~DiskStreamer() override {
+    stopThread(-1);
+    removeListener(this);
+  }
+
+  // Ask for a stream's ring to be topped up. Wait-free and safe on the audio
+  // thread; returns false if the request queue is full
+  bool requestRefill(std::shared_ptr<detail::StreamState> stream) {
+    if (!requests.push(std::move(stream)))
+      return false;
+
+    wakeUp.notify();
+    return true;
+  }
 
 private:
-  size_t size;
-  TypedQueue queue;
+  void run() override;
+  void exitSignalSent() override { wakeUp.notify(); }
+
+  MpscQueue<std::shared_ptr<detail::StreamState>> requests;
+  Signal wakeUp;
 };
 
-template <typename T, typename Options> class Loader : public juce::Thread {
-  static_assert(std::is_constructible_v<T, Options>,
-                "T must be constructible with Options");
-  static_assert(std::is_default_constructible_v<Options>,
-                "Options must be default constructible");
+namespace detail {
 
+// A StreamingSound's read-ahead ring, shared with the DiskStreamer. Positions
+// are in samples from the start of the file, and a file position lives at
+// the same position modulo capacity in the ring.
+//
+// The audio thread owns the read position and the streamer the write
+// position. Each is packed into one atomic together with a seek generation,
+// so after a seek the audio thread knows to ignore what's in the ring until
+// the streamer has started writing from the new position. Within one
+// generation the streamer only writes ahead of the read position, which is
+// what keeps the block the audio thread is looking at intact.
+class StreamState : public std::enable_shared_from_this<StreamState> {
 public:
-  // A unique pointer to the object type
-  using ObjPtr = std::unique_ptr<T>;
+  StreamState(std::unique_ptr<juce::AudioFormatReader> formatReader,
+              DiskStreamer &diskStreamer, juce::int64 start, int capacity)
+      : reader(std::move(formatReader)), streamer(diskStreamer),
+        numSamples(reader->lengthInSamples),
+        ring((int)reader->numChannels, capacity),
+        readState(pack(start, 0)), writeState(pack(start, 0)) {}
 
-  // A single reader single writer queue for object creation.
-  // The options for initializing the object are their own type
-  // and the object's initializer should take that type as an argument
-  using OptionsQueue = moodycamel::ReaderWriterQueue<Options>;
+  //==== audio thread
 
-  // A single reader single writer queue for the objects themselves
-  // used to pass the objects back to the audio thread
-  using ObjectQueue = moodycamel::ReaderWriterQueue<ObjPtr>;
+  // Up to numSamples from start, stopping at the ring's wrap and at what's
+  // been read from disk so far. Anything outside what's buffered is a seek,
+  // which comes back empty until the streamer catches up
+  juce::dsp::AudioBlock<const float> read(juce::int64 start,
+                                          juce::int64 numToRead) {
+    const auto r = readState.load(std::memory_order_relaxed);
+    const auto w = writeState.load(std::memory_order_acquire);
+    const auto readPos = positionOf(r);
+    const auto writePos =
+        generationOf(w) == generationOf(r) ? positionOf(w) : readPos;
 
-  // A callback for when an object is grabbed from the queue by the
-  // audio thread. The object is passed as an ObjPtr
-  using CallBack = std::function<void(ObjPtr)>;
+    if (start < readPos || start > writePos) {
+      seek(start);
+      return {};
+    }
 
-  Loader(const juce::String &name, size_t initialSize = 25,
-         bool shouldOnlyUseLastMessage = false)
-      : juce::Thread(name), onlyUseLastMessage(shouldOnlyUseLastMessage),
-        toLoad(initialSize), loaded(initialSize), toDestroy(initialSize) {}
+    readState.store(pack(start, generationOf(r)), std::memory_order_release);
+    if (readPos + getCapacity() - writePos >= getCapacity() / 2 &&
+        writePos < numSamples)
+      refillSoon();
 
-  // Load options into the queue for creation
-  bool load(Options &&creator) {
-    const auto ret = toLoad.try_enqueue(creator);
-    notify();
-    return ret;
+    const auto offset = start % getCapacity();
+    numToRead =
+        std::min({numToRead, writePos - start, getCapacity() - offset});
+    return juce::dsp::AudioBlock<const float>(
+        ring.getArrayOfReadPointers(), (size_t)ring.getNumChannels(),
+        (size_t)offset, (size_t)numToRead);
   }
 
-  // Load options into the queue for creation
-  bool load(const Options &creator) {
-    const auto ret = toLoad.try_enqueue(creator);
-    notify();
-    return ret;
+  // Make the ring start filling from position, unless that's where it's
+  // already reading from
+  void rewindTo(juce::int64 position) {
+    if (positionOf(readState.load(std::memory_order_relaxed)) != position)
+      seek(position);
   }
 
-  // Queue an object for destruction
-  void destroy(ObjPtr object) {
-    toDestroy.enqueue(std::move(object));
-    notify();
-  }
+  //==== streamer thread
 
-  // Pop a single loaded object from the queue
-  bool getLoaded(ObjPtr &loadedT) { return loaded.try_dequeue(loadedT); }
+  void refill() {
+    refillPending.store(false, std::memory_order_release);
 
-  // For each loaded object, run a callback on that object
-  void forEach(CallBack cbk) {
-    ObjPtr t;
-    while (loaded.try_dequeue(t))
-      cbk(std::move(t));
-  }
+    const auto r = readState.load(std::memory_order_acquire);
+    const auto w = writeState.load(std::memory_order_relaxed);
+    const auto generation = generationOf(r);
+    auto writePos =
+        generationOf(w) == generation ? positionOf(w) : positionOf(r);
+    const auto end = std::min(positionOf(r) + getCapacity(), numSamples);
 
-  // Start the loader background thread
-  void run() override {
-    while (true) {
-      if (threadShouldExit())
-        return;
+    const auto numChannels = ring.getNumChannels();
+    juce::HeapBlock<float *> chunk((size_t)numChannels);
 
-      loadAndDestroy();
+    while (writePos < end) {
+      const auto offset = writePos % getCapacity();
+      const auto num = (int)std::min(end - writePos, getCapacity() - offset);
 
-      if (threadShouldExit())
-        return;
+      for (int channel = 0; channel < numChannels; ++channel)
+        chunk[(size_t)channel] = ring.getWritePointer(channel, (int)offset);
+
+      if (!reader->read(chunk.get(), numChannels, writePos, num))
+        break;
 
-      wait(-1);
+      writePos += num;
+      writeState.store(pack(writePos, generation), std::memory_order_release);
+
+      // A seek since means this is going to the wrong place
+      if (generationOf(readState.load(std::memory_order_acquire)) !=
+          generation)
+        break;
     }
   }
 
-  ~Loader() override {}
+  juce::int64 getCapacity() const noexcept { return ring.getNumSamples(); }
 
 private:
-  void loadAndDestroy() {
-    Options creator;
+  static constexpr int generationBits = 16;
+  static constexpr juce::uint64 generationMask = (1 << generationBits) - 1;
 
-    if (onlyUseLastMessage) {
-      auto atLeastOne = false;
-      while (toLoad.try_dequeue(creator)) {
-        atLeastOne = true;
-      }
-      if (atLeastOne) {
-        loaded.try_enqueue(std::make_unique<T>(creator));
-      }
-    } else {
-      while (toLoad.try_dequeue(creator)) {
-        loaded.try_enqueue(std::make_unique<T>(creator));
-      }
-    }
+  static juce::uint64 pack(juce::int64 position, juce::uint64 generation) {
+    return ((juce::uint64)position << generationBits) |
+           (generation & generationMask);
+  }
+  static juce::int64 positionOf(juce::uint64 state) {
+    return (juce::int64)(state >> generationBits);
+  }
+  static juce::uint64 generationOf(juce::uint64 state) {
+    return state & generationMask;
+  }
 
-    // Destroy objects that are no longer used
-    ObjPtr object;
-    while (toDestroy.try_dequeue(object)) {
-      object.reset();
-    }
+  void seek(juce::int64 position) {
+    const auto r = readState.load(std::memory_order_relaxed);
+    readState.store(pack(position, generationOf(r) + 1),
+                    std::memory_order_release);
+    refillSoon();
   }
 
-  // Whenever looping through the options to load into objects, only use
-  // the last one in the queue
-  bool onlyUseLastMessage;
+  void refillSoon() {
+    if (refillPending.exchange(true, std::memory_order_acq_rel))
+      return;
 
-  // Some other thread (the GUI or audio thread, but not both!) writes creator
-  // structs, Loader consumes them in its own thread
-  OptionsQueue toLoad;
+    if (!streamer.requestRefill(shared_from_this()))
+      refillPending.store(false, std::memory_order_release);
+  }
 
-  // Loader pushes objects to this queue in its own thread after creating them,
-  // and the audio thread consumes them
-  ObjectQueue loaded;
+  std::unique_ptr<juce::AudioFormatReader> reader;
+  DiskStreamer &streamer;
+  const juce::int64 numSamples;
+  juce::AudioBuffer<float> ring;
 
-  // The audio thread pushes objects to this queue, Loader destroys them in its
-  // own thread
-  ObjectQueue toDestroy;
+  std::atomic<juce::uint64> readState;
+  std::atomic<juce::uint64> writeState;
+  std::atomic<bool> refillPending{false};
 };
 
-class LoadableSound {
+} // namespace detail
+
+inline void DiskStreamer::run() {
+  while (!threadShouldExit()) {
+    std::shared_ptr<detail::StreamState> stream;
+    while (requests.pop(stream)) {
+      stream->refill();
+      stream.reset();
+    }
+
+    wakeUp.wait();
+  }
+}
 
+// A sound played straight from disk, for files too long to hold in memory.
+// The first headMillis are decoded up front; after that the audio thread
+// reads from a ring of ringSamples per channel that the DiskStreamer keeps
+// topped up, asking for more whenever half of it has been played. Memory
+// stays the same whatever the length of the file.
+//
+// getBlock() takes and returns the same as LoadableSound's, but the block is
+// only valid until the next call, and it comes back short at the ring's wrap
+// and empty where the disk hasn't kept up, so ask again for the rest. Going
+// back into the head makes the ring start over just after it, so looping
+// from the top never runs dry.
+class StreamingSound {
 public:
   struct Options {
     juce::String name;
     juce::File path;
-    juce::AudioFormatManager *formatManager;
+    juce::AudioFormatManager *formatManager = nullptr;
+
+    // How much to decode up front
+    double headMillis = 500.0;
+
+    // The read-ahead ring's length per channel
+    int ringSamples = 32768;
   };
 
-  LoadableSound(Options const &opts) : name(opts.name) {
-    // Bail if the file doesn't exist
+  StreamingSound(Options const &opts) : name(opts.name) {
     if (!opts.path.existsAsFile()) {
       return;
     }
@@ -287,42 +4259,384 @@ public:
       return;
     }
 
-    const int numChannels = (int)reader->numChannels;
-    const int numSamples = (int)reader->lengthInSamples;
+    lengthInSamples = (juce::int64)reader->lengthInSamples;
+    sampleRate = reader->sampleRate;
+    headLength = juce::jmin(
+        lengthInSamples,
+        (juce::int64)(opts.headMillis * 0.001 * sampleRate));
 
-    buffer.setSize(numChannels, numSamples);
-    auto writePointers = buffer.getArrayOfWritePointers();
+    head.setSize((int)reader->numChannels, (int)headLength);
+    if (!reader->read(head.getArrayOfWritePointers(), head.getNumChannels(),
+                      0, (int)headLength)) {
+      lengthInSamples = headLength = 0;
+      return;
+    }
 
-    if (reader->read(writePointers, numChannels, 0, numSamples)) {
-      valid = true;
-    };
+    if (headLength < lengthInSamples) {
+      stream = std::make_shared<detail::StreamState>(
+          std::move(reader), *streamer, headLength, opts.ringSamples);
+      stream->refill();
+    }
+  }
+
+  void makeResident() {
+    if (headLength > 0)
+      headPages = ResidentMemory::getInstance().makeResident(
+          head.getReadPointer(0), (size_t)head.getNumChannels() *
+                                      (size_t)headLength * sizeof(float));
   }
 
   const juce::String &getName() const { return name; }
 
-  juce::dsp::AudioBlock<float> getBlock(size_t startSample, size_t numSamples) {
-    const auto numSamplesInBuffer = getNumSamples();
+  juce::dsp::AudioBlock<const float> getBlock(size_t startSample,
+                                              size_t numSamples) {
+    const auto start = (juce::int64)startSample;
+    if (start >= lengthInSamples) {
+      return juce::dsp::AudioBlock<const float>();
+    }
 
-    if (numSamplesInBuffer == 0) {
-      return juce::dsp::AudioBlock<float>();
+    if (start < headLength) {
+      if (stream != nullptr) {
+        stream->rewindTo(headLength);
+      }
+
+      const auto num = juce::jmin((juce::int64)numSamples, headLength - start);
+      return juce::dsp::AudioBlock<const float>(
+          head.getArrayOfReadPointers(), getNumChannels(), startSample,
+          (size_t)num);
     }
 
-    startSample = juce::jmin(startSample, numSamplesInBuffer - 1);
-    numSamples = juce::jmin(numSamples, numSamplesInBuffer - startSample);
-    return juce::dsp::AudioBlock<float>(buffer).getSubBlock(startSample,
-                                                            numSamples);
+    return stream->read(start, (juce::int64)numSamples);
   }
 
-  size_t getNumChannels() const { return (size_t)buffer.getNumChannels(); }
-  size_t getNumSamples() const { return (size_t)buffer.getNumSamples(); }
+  size_t getNumChannels() const { return (size_t)head.getNumChannels(); }
+  size_t getNumSamples() const { return (size_t)lengthInSamples; }
+  double getSampleRate() const { return sampleRate; }
 
 private:
-  bool valid = false;
   juce::String name;
-  juce::AudioBuffer<float> buffer;
+  juce::int64 lengthInSamples = 0;
+  juce::int64 headLength = 0;
+  double sampleRate = 0.0;
+  juce::AudioBuffer<float> head;
+  ResidentMemory::Lock headPages;
+  juce::SharedResourcePointer<DiskStreamer> streamer;
+  std::shared_ptr<detail::StreamState> stream;
+};
+
+namespace detail {
+// Turns interleaved frames of one sample format into float channels, through
+// JUCE's converters so the inner loops stay simple enough to vectorise
+using FrameConverter = void (*)(const void *frames, float *const *channels,
+                                int numChannels, int numSamples);
+
+template <typename SampleFormat, typename Endianness>
+void convertFrames(const void *frames, float *const *channels, int numChannels,
+                   int numSamples) {
+  using Source = juce::AudioData::Format<SampleFormat, Endianness>;
+  using Dest =
+      juce::AudioData::Format<juce::AudioData::Float32,
+                              juce::AudioData::NativeEndian>;
+  juce::AudioData::deinterleaveSamples(
+      juce::AudioData::InterleavedSource<Source>{frames, numChannels},
+      juce::AudioData::NonInterleavedDest<Dest>{channels, numChannels},
+      numSamples);
+}
+
+template <typename Endianness>
+FrameConverter frameConverterFor(unsigned int bits, bool isFloat) {
+  using namespace juce;
+  if (isFloat)
+    return bits == 32 ? convertFrames<AudioData::Float32, Endianness>
+                      : nullptr;
+
+  switch (bits) {
+  case 16:
+    return convertFrames<AudioData::Int16, Endianness>;
+  case 24:
+    return convertFrames<AudioData::Int24, Endianness>;
+  case 32:
+    return convertFrames<AudioData::Int32, Endianness>;
+  default:
+    return nullptr;
+  }
+}
+
+// sampleToPointer() is protected, but a pointer to it taken through a
+// subclass can be called on any reader
+struct MappedFrames : juce::MemoryMappedAudioFormatReader {
+  static const void *
+  start(const juce::MemoryMappedAudioFormatReader &reader) {
+    return (reader.*&MappedFrames::sampleToPointer)(0);
+  }
+};
+} // namespace detail
+
+// A sound played straight out of a memory-mapped WAV or AIFF file, so loading
+// it decodes nothing and its pages sit in the OS page cache, shared with every
+// other instance and process using the same file. Compressed formats have no
+// mapped reader and come out with no samples, so use LoadableSound for those.
+//
+// getBlock() takes and returns the same as LoadableSound's. Mono 32-bit float
+// in native byte order comes directly from the mapping; anything else is
+// converted into a scratch buffer, at most maxBlockSize samples at a time, so
+// the block is only valid until the next call and may come back short.
+class MappedSound {
+public:
+  struct Options {
+    juce::String name;
+    juce::File path;
+    juce::AudioFormatManager *formatManager = nullptr;
+
+    // The most getBlock() converts per call
+    int maxBlockSize = 4096;
+  };
+
+  MappedSound(Options const &opts) : name(opts.name) {
+    auto *format = opts.formatManager->findFormatForFileExtension(
+        opts.path.getFileExtension());
+    if (format == nullptr || !opts.path.existsAsFile()) {
+      return;
+    }
+
+    reader.reset(format->createMemoryMappedReader(opts.path));
+    if (!reader || reader->lengthInSamples <= 0 || !reader->mapEntireFile()) {
+      reader.reset();
+      return;
+    }
+
+    const auto bits = reader->bitsPerSample;
+    const auto isFloat = reader->usesFloatingPointData;
+    frames = static_cast<const char *>(detail::MappedFrames::start(*reader));
+    bytesPerFrame = (size_t)reader->numChannels * bits / 8;
+
+    // WAV is little-endian and AIFF big-endian, except for AIFF-C 'sowt'
+    // files, so check the guess against the reader on one frame
+    const bool wav = format->getFormatName().containsIgnoreCase("WAV");
+    const auto little =
+        detail::frameConverterFor<juce::AudioData::LittleEndian>(bits,
+                                                                 isFloat);
+    const auto big =
+        detail::frameConverterFor<juce::AudioData::BigEndian>(bits, isFloat);
+    convert = wav ? little : big;
+    if (convert != nullptr && !matchesReader(convert)) {
+      convert = wav ? big : little;
+      if (!matchesReader(convert)) {
+        convert = nullptr;
+      }
+    }
+
+    if (convert == nullptr) {
+      reader.reset();
+      return;
+    }
+
+    const bool nativeFloat =
+        isFloat && bits == 32 &&
+        convert == detail::frameConverterFor<juce::AudioData::NativeEndian>(
+                       bits, isFloat);
+    if (nativeFloat && reader->numChannels == 1 &&
+        reinterpret_cast<std::uintptr_t>(frames) % alignof(float) == 0) {
+      mappedChannel = reinterpret_cast<const float *>(frames);
+    } else {
+      scratch.setSize((int)reader->numChannels, opts.maxBlockSize);
+    }
+  }
+
+  // Reads the whole mapping in, and writes the scratch buffer once so its
+  // pages are real rather than shared zero pages
+  void makeResident() {
+    if (reader)
+      pages = ResidentMemory::getInstance().makeResident(
+          frames, getNumSamples() * bytesPerFrame);
+    scratch.clear();
+  }
+
+  const juce::String &getName() const { return name; }
+
+  juce::dsp::AudioBlock<const float> getBlock(size_t startSample,
+                                              size_t numSamples) {
+    if (startSample >= getNumSamples()) {
+      return juce::dsp::AudioBlock<const float>();
+    }
+
+    numSamples = juce::jmin(numSamples, getNumSamples() - startSample);
+    if (mappedChannel != nullptr) {
+      return juce::dsp::AudioBlock<const float>(&mappedChannel, 1,
+                                                startSample, numSamples);
+    }
+
+    numSamples = juce::jmin(numSamples, (size_t)scratch.getNumSamples());
+    convert(frames + startSample * bytesPerFrame,
+            scratch.getArrayOfWritePointers(), scratch.getNumChannels(),
+            (int)numSamples);
+    return juce::dsp::AudioBlock<const float>(
+        scratch.getArrayOfReadPointers(), getNumChannels(), 0, numSamples);
+  }
+
+  // True when getBlock() hands out the mapping itself
+  bool isZeroCopy() const { return mappedChannel != nullptr; }
+
+  size_t getNumChannels() const {
+    return reader ? (size_t)reader->numChannels : 0;
+  }
+  size_t getNumSamples() const {
+    return reader ? (size_t)reader->lengthInSamples : 0;
+  }
+  double getSampleRate() const { return reader ? reader->sampleRate : 0.0; }
+
+private:
+  bool matchesReader(detail::FrameConverter converter) const {
+    if (converter == nullptr) {
+      return false;
+    }
+
+    const auto channels = (int)reader->numChannels;
+    const auto sample = reader->lengthInSamples / 2;
+    std::vector<float> expected((size_t)channels), converted((size_t)channels);
+    std::vector<float *> pointers;
+    for (auto &value : converted)
+      pointers.push_back(&value);
+
+    reader->getSample(sample, expected.data());
+    converter(frames + (size_t)sample * bytesPerFrame, pointers.data(),
+              channels, 1);
+    return std::equal(expected.begin(), expected.end(), converted.begin(),
+                      [](float a, float b) { return std::abs(a - b) < 1e-6f; });
+  }
+
+  juce::String name;
+  std::unique_ptr<juce::MemoryMappedAudioFormatReader> reader;
+  const char *frames = nullptr;
+  size_t bytesPerFrame = 0;
+  detail::FrameConverter convert = nullptr;
+  const float *mappedChannel = nullptr;
+  juce::AudioBuffer<float> scratch;
+  ResidentMemory::Lock pages;
 };
 
 using SoundLoader = Loader<LoadableSound, LoadableSound::Options>;
 
+// A SoundLoader that takes load() calls from any number of threads
+using MpscSoundLoader =
+    Loader<LoadableSound, LoadableSound::Options, MpscQueue>;
+
+// A SoundLoader built on the process-wide pool, for plugins with many
+// instances
+using SharedSoundLoader =
+    SharedLoader<LoadableSound, LoadableSound::Options>;
+
+// Loads StreamingSounds on the process-wide pool
+using StreamingSoundLoader =
+    SharedLoader<StreamingSound, StreamingSound::Options>;
+
+// Maps sounds on the process-wide pool
+using MappedSoundLoader = SharedLoader<MappedSound, MappedSound::Options>;
+
+// Keeps a SampleCache warm around the current position in a list of files,
+// so stepping through a kit one sample after another finds each one already
+// decoded. The next and previous numNeighbours files are loaded at prefetch
+// priority on the shared loader pool, and moving on cancels whatever is no
+// longer close. Call it from the message thread. The format manager has to
+// outlive any loads still running.
+class SoundPrefetcher {
+public:
+  // With a disk cache, what's prefetched is written there too, so it maps
+  // straight back in next session
+  SoundPrefetcher(std::shared_ptr<SampleCache> sampleCache,
+                  juce::AudioFormatManager &manager, int neighbours = 2,
+                  double sampleRateToDecodeFor = 0.0,
+                  std::shared_ptr<DiskSampleCache> diskSampleCache = nullptr)
+      : cache(std::move(sampleCache)),
+        diskCache(std::move(diskSampleCache)), formatManager(manager),
+        numNeighbours(neighbours), sampleRate(sampleRateToDecodeFor),
+        loader((size_t)(4 * neighbours + 2)) {}
+
+  ~SoundPrefetcher() {
+    cancelAll();
+    discardLoaded();
+  }
+
+  // Replace the list, cancelling everything in flight
+  void setFiles(const juce::Array<juce::File> &newFiles) {
+    cancelAll();
+    files = newFiles;
+  }
+
+  // Prefetch around index, nearest first and forwards before backwards
+  void setPosition(int index) {
+    position = index;
+    discardLoaded();
+
+    for (auto it = pending.begin(); it != pending.end();) {
+      if (std::abs(it->first - index) > numNeighbours) {
+        it->second.cancel();
+        it = pending.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    for (int distance = 1; distance <= numNeighbours; ++distance) {
+      request(index + distance);
+      request(index - distance);
+    }
+  }
+
+  // Decode for a new rate from now on, starting again around the current
+  // position. What was decoded for the old rate ages out of the cache
+  void setSampleRate(double newSampleRate) {
+    if (newSampleRate == sampleRate)
+      return;
+
+    cancelAll();
+    sampleRate = newSampleRate;
+    if (position >= 0)
+      setPosition(position);
+  }
+
+private:
+  void request(int index) {
+    if (index < 0 || index >= files.size() || pending.count(index) > 0)
+      return;
+
+    const auto file = files[index];
+    LoadableSound::Options opts;
+    opts.name = file.getFileNameWithoutExtension();
+    opts.path = file;
+    opts.formatManager = &formatManager;
+    opts.sampleRate = sampleRate;
+    opts.cache = cache;
+    opts.diskCache = diskCache;
+
+    auto ticket = loader.load(std::move(opts), LoadPriority::prefetch);
+    if (ticket)
+      pending.emplace(index, ticket);
+  }
+
+  void cancelAll() {
+    for (auto &entry : pending)
+      entry.second.cancel();
+    pending.clear();
+  }
+
+  // The sounds themselves aren't wanted, only what they left in the cache
+  void discardLoaded() {
+    SharedSoundLoader::ObjPtr sound;
+    while (loader.getLoaded(sound))
+      sound.reset();
+  }
+
+  std::shared_ptr<SampleCache> cache;
+  std::shared_ptr<DiskSampleCache> diskCache;
+  juce::AudioFormatManager &formatManager;
+  const int numNeighbours;
+  double sampleRate;
+  int position = -1;
+  juce::Array<juce::File> files;
+  std::map<int, LoadTicket> pending;
+  SharedSoundLoader loader;
+};
+
 } // namespace lockfree
 } // namespace musikhack
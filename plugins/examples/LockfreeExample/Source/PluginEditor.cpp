@@ -11,15 +11,15 @@
 
 //==============================================================================
 LockfreeExampleEditor::LockfreeExampleEditor(LockfreeExampleProcessor &p)
-    : AudioProcessorEditor(&p), audioProcessor(p) {
-
-  // Prepare for loading AIFF/WAV
-  formatManager.registerBasicFormats();
+    : AudioProcessorEditor(&p), audioProcessor(p),
+      prefetcher(p.getSampleCache(), p.getFormatManager(), 2,
+                 p.getHostSampleRate(), p.getDiskCache()) {
 
   // Store all sample file paths in a big array
   const auto sampleDir = juce::File(MUSIKHACK_SAMPLES_DIR);
   sampleFiles =
       sampleDir.findChildFiles(juce::File::findFiles, true, "*.wav;*.aif");
+  prefetcher.setFiles(sampleFiles);
 
   // Configure the slider to queue loading up a sound when the value changes
   fileSelector.setRange(0, sampleFiles.size() - 1, 1);
@@ -28,8 +28,8 @@ LockfreeExampleEditor::LockfreeExampleEditor(LockfreeExampleProcessor &p)
   fileSelector.onValueChange = [this]() {
     const auto index = static_cast<int>(fileSelector.getValue());
     const auto f = sampleFiles[index];
-    audioProcessor.queueSoundLoad(
-        {f.getFileNameWithoutExtension(), f, &formatManager});
+    audioProcessor.queueSoundLoad({f.getFileNameWithoutExtension(), f});
+    prefetcher.setPosition(index);
   };
 
   fileSelector.textFromValueFunction = [this](double value) {
@@ -54,6 +54,7 @@ LockfreeExampleEditor::~LockfreeExampleEditor() { stopTimer(); }
 
 void LockfreeExampleEditor::timerCallback() {
   repaint();
+  prefetcher.setSampleRate(audioProcessor.getHostSampleRate());
   audioProcessor.getLogQueue().forEach(
       [&](Logger::Message const &msg) { DBG(Logger::format(msg)); });
 }
@@ -86,14 +87,15 @@ void LockfreeExampleEditor::paint(juce::Graphics &g) {
 
   // draw peak and RMS meters
   const auto indicatorWidth = 15.;
-  const auto peakVal = audioProcessor.getPeak();
+  const auto &meters = audioProcessor.getMeters();
+  const auto peakVal = juce::jmax(meters.peak[0], meters.peak[1]);
   lastMeterVal *= 0.9f;
   lastMeterVal = juce::jmax(peakVal, lastMeterVal);
   g.setColour(offWhite.withAlpha(lastMeterVal));
   g.fillEllipse(static_cast<float>(getWidth() - indicatorWidth - 10), 10,
                 indicatorWidth, indicatorWidth);
 
-  g.setColour(offWhite.withAlpha(audioProcessor.getRMS()));
+  g.setColour(offWhite.withAlpha(meters.rms[0]));
   g.fillEllipse(static_cast<float>(getWidth() - indicatorWidth - 40), 10,
                 indicatorWidth, indicatorWidth);
 }
@@ -29,8 +29,10 @@ private:
   // This reference is provided as a quick way for your editor to
   // access the processor object that created it.
   LockfreeExampleProcessor &audioProcessor;
-  juce::AudioFormatManager formatManager;
   juce::Array<juce::File> sampleFiles;
+  // Decodes the files either side of the slider ahead of time, with the
+  // processor's format manager, since its loads can outlast the editor
+  musikhack::lockfree::SoundPrefetcher prefetcher;
   juce::Slider fileSelector;
   juce::Label title;
   int xPos = 0;
@@ -24,15 +24,14 @@ LockfreeExampleProcessor::LockfreeExampleProcessor()
               .withOutput("Output", juce::AudioChannelSet::stereo(), true)
 #endif
               ),
-      vizRing(512), logQueue(1024), soundLoader("SoundLoader", 5, true)
+      soundLoader(5, true)
 #endif
 {
-  soundLoader.startThread();
+  // Prepare for loading AIFF/WAV
+  formatManager.registerBasicFormats();
 }
 
-LockfreeExampleProcessor::~LockfreeExampleProcessor() {
-  soundLoader.stopThread(2000);
-}
+LockfreeExampleProcessor::~LockfreeExampleProcessor() {}
 
 //==============================================================================
 const juce::String LockfreeExampleProcessor::getName() const {
@@ -90,6 +89,17 @@ void LockfreeExampleProcessor::prepareToPlay(double sr,
   RMSBuffer.setSize(2, static_cast<int>(sr * 0.3)); // 300ms RMS
   RMSBuffer.clear();
   RMSBufferPosition = 0;
+
+  // The host may call this from any thread, so reload from the message
+  // thread, which is the only one that queues loads
+  if (hostSampleRate.exchange(sr) != sr)
+    triggerAsyncUpdate();
+}
+
+void LockfreeExampleProcessor::handleAsyncUpdate() {
+  if (lastSoundOptions.path != juce::File() &&
+      lastSoundOptions.sampleRate != hostSampleRate.load())
+    queueSoundLoad(lastSoundOptions);
 }
 
 void LockfreeExampleProcessor::releaseResources() {
@@ -133,39 +143,54 @@ void LockfreeExampleProcessor::processBlock(
   const auto numSamples = block.getNumSamples();
   const auto numChannels = block.getNumChannels();
 
-  soundLoader.forEach(
-      [&](std::unique_ptr<musikhack::lockfree::LoadableSound> sound) {
-        loadedSound = std::move(sound);
-        samplePosition = 0;
-        logQueue.push({Logger::ID::NEW_SOUND, 0});
-        loopCount = 0;
-      });
+  // Try again with a sound the destroy queue had no room for last block
+  if (soundToDestroy)
+    soundLoader.destroy(std::move(soundToDestroy));
+
+  // Hand the old sound back so it's freed on the loader thread. The pool
+  // thread may be busy decoding while sounds keep arriving, so the destroy
+  // queue can fill up. Then the old sound waits in soundToDestroy, and new
+  // ones wait in the loader's queue, until there's room again
+  std::unique_ptr<musikhack::lockfree::LoadableSound> sound;
+  while (!soundToDestroy && soundLoader.getLoaded(sound)) {
+    if (loadedSound && !soundLoader.destroy(std::move(loadedSound)))
+      soundToDestroy = std::move(loadedSound);
+    loadedSound = std::move(sound);
+    samplePosition = getAudibleRange(*loadedSound).first;
+    logQueue.push({Logger::ID::NEW_SOUND, 0});
+    loopCount = 0;
+  }
 
-  if (loadedSound) {
-    auto smp = loadedSound->getBlock(samplePosition, numSamples);
+  // Empty when playback has caught up with a progressive load, in which case
+  // this block stays silent and the position waits for the decoder
+  auto smp = loadedSound ? loadedSound->getBlock(samplePosition, numSamples)
+                         : juce::dsp::AudioBlock<const float>();
+  if (smp.getNumChannels() > 0) {
     const auto numSamplesRead = smp.getNumSamples();
     for (size_t c = 0; c < numChannels; c++) {
-      auto data = c > smp.getNumChannels() - 1 ? smp.getChannelPointer(0)
-                                               : smp.getChannelPointer(c);
+      auto data = c >= smp.getNumChannels() ? smp.getChannelPointer(0)
+                                            : smp.getChannelPointer(c);
       auto dest = block.getChannelPointer(c);
+      for (size_t s = 0; s < numSamplesRead; s++) {
+        dest[s] = data[s];
+      }
       if (c == 0) {
-        for (size_t s = 0; s < numSamplesRead; s++) {
-          dest[s] = data[s];
-          vizRing.push(data[s]);
-        }
-      } else {
-        for (size_t s = 0; s < numSamplesRead; s++) {
-          dest[s] = data[s];
-        }
+        // hand the whole block to the GUI at once
+        vizRing.pushN(data, numSamplesRead);
       }
     }
-    samplePosition += numSamples;
-    if (samplePosition >= loadedSound->getNumSamples()) {
-      samplePosition = 0;
+    // Only as far as was read, which is short of numSamples where decoding
+    // hasn't got to yet
+    samplePosition += numSamplesRead;
+    const auto audible = getAudibleRange(*loadedSound);
+    if (samplePosition >= audible.second) {
+      samplePosition = audible.first;
       logQueue.push({Logger::ID::LOOP, (double)++loopCount});
     }
 
-    const auto arbitrarySample = std::abs(block.getSample(0, 0));
+    const auto arbitrarySample =
+        numChannels > 0 && numSamplesRead > 0 ? std::abs(block.getSample(0, 0))
+                                              : 0.0f;
     if (arbitrarySample > 0.21 && arbitrarySample < 0.28) {
       logQueue.push({Logger::ID::RANDOM_MESSAGE, arbitrarySample});
     }
@@ -190,8 +215,22 @@ void LockfreeExampleProcessor::processBlock(
     RMSBufferPosition = remainingSamples;
   }
 
-  peakMeter = buffer.getMagnitude(0, (int)numSamples);
-  rmsMeter = RMSBuffer.getRMSLevel(0, 0, RMSBuffer.getNumSamples());
+  // fill in every meter, then hand them all to the GUI in one go. Hosts
+  // can call with no channels at all, which reads as silence
+  auto &state = meters.getWriteBuffer();
+  for (size_t c = 0; c < state.peak.size(); c++) {
+    if (numChannels == 0) {
+      state.peak[c] = state.rms[c] = 0.0f;
+      continue;
+    }
+
+    const auto channel = (int)juce::jmin(c, numChannels - 1);
+    state.peak[c] = buffer.getMagnitude(channel, 0, (int)numSamples);
+    state.rms[c] =
+        RMSBuffer.getRMSLevel(channel, 0, RMSBuffer.getNumSamples());
+  }
+  state.playPosition = samplePosition;
+  meters.publish();
 }
 
 //==============================================================================
@@ -8,10 +8,13 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <juce_audio_processors/juce_audio_processors.h>
 #include <memory>
 #include <musikhack/lockfree/lockfree.h>
 #include <unordered_map>
+#include <utility>
 
 //==============================================================================
 /**
@@ -41,8 +44,23 @@ struct Logger {
   }
 };
 
-class LockfreeExampleProcessor : public juce::AudioProcessor {
+class LockfreeExampleProcessor : public juce::AudioProcessor,
+                                 private juce::AsyncUpdater {
 public:
+  // The scope only cares about the latest audio, so the ring drops old samples
+  // rather than new ones when the editor can't keep up
+  using VizRing =
+      musikhack::lockfree::StaticRing<float, 512,
+                                      musikhack::lockfree::Overflow::overwriteOldest>;
+  using LogQueue = musikhack::lockfree::StaticRing<Logger::Message, 1024>;
+
+  // Everything the meters need, published once per block
+  struct Meters {
+    std::array<float, 2> peak{};
+    std::array<float, 2> rms{};
+    size_t playPosition = 0;
+  };
+
   //==============================================================================
   LockfreeExampleProcessor();
   ~LockfreeExampleProcessor() override;
@@ -50,7 +68,7 @@ public:
   //==============================================================================
   void prepareToPlay(double sampleRate, int samplesPerBlock) override;
   void releaseResources() override;
-  musikhack::lockfree::Ring<float> &getVizRing() { return vizRing; }
+  VizRing &getVizRing() { return vizRing; }
 
 #ifndef JucePlugin_PreferredChannelConfigurations
   bool isBusesLayoutSupported(const BusesLayout &layouts) const override;
@@ -81,32 +99,86 @@ public:
   void getStateInformation(juce::MemoryBlock &destData) override;
   void setStateInformation(const void *data, int sizeInBytes) override;
 
-  // call via the editor/message thread
-  void queueSoundLoad(musikhack::lockfree::LoadableSound::Options const &opts) {
-    soundLoader.load(opts);
+  // call via the editor/message thread. Sounds are always decoded with this
+  // processor's format manager rather than the caller's, which may be gone
+  // by the time the load runs, or is replayed after a rate change
+  void queueSoundLoad(musikhack::lockfree::LoadableSound::Options opts) {
+    opts.formatManager = &formatManager;
+    opts.cache = sampleCache;
+    opts.diskCache = diskCache;
+    // Start playing long files before they're fully decoded
+    opts.progressiveMillis = 100.0;
+    // Convert to the host's rate once here rather than on every block
+    opts.sampleRate = hostSampleRate.load();
+    lastSoundOptions = opts;
+    soundLoader.load(std::move(opts));
+  }
+
+  // The rate sounds are decoded for, or 0 before prepareToPlay
+  double getHostSampleRate() const { return hostSampleRate.load(); }
+
+  LogQueue &getLogQueue() { return logQueue; }
+
+  juce::AudioFormatManager &getFormatManager() { return formatManager; }
+
+  std::shared_ptr<musikhack::lockfree::SampleCache> getSampleCache() const {
+    return sampleCache;
   }
 
-  musikhack::lockfree::Queue<Logger::Message> &getLogQueue() {
-    return logQueue;
+  std::shared_ptr<musikhack::lockfree::DiskSampleCache> getDiskCache() const {
+    return diskCache;
   }
 
-  float getPeak() const { return peakMeter.load(); }
-  float getRMS() const { return rmsMeter.load(); }
+  // call via the editor/message thread only
+  const Meters &getMeters() { return meters.read(); }
 
 private:
+  // Reloads the current sound after the host rate changes
+  void handleAsyncUpdate() override;
+
+  // Where to start and loop, leaving out the silence either end once the
+  // loader has analysed the sound
+  static std::pair<size_t, size_t>
+  getAudibleRange(const musikhack::lockfree::LoadableSound &sound) {
+    const auto *analysis = sound.getAnalysis();
+    if (analysis == nullptr ||
+        analysis->getSoundEnd() <= analysis->getSoundStart())
+      return {0, sound.getNumSamples()};
+    return {(size_t)analysis->getSoundStart(),
+            (size_t)analysis->getSoundEnd()};
+  }
+
   size_t samplePosition = 0;
   size_t loopCount = 0;
 
   juce::AudioBuffer<float> RMSBuffer;
   size_t RMSBufferPosition = 0;
 
-  std::atomic<float> peakMeter = 0.f;
-  std::atomic<float> rmsMeter = 0.f;
-
-  musikhack::lockfree::Ring<float> vizRing;
-  musikhack::lockfree::Queue<Logger::Message> logQueue;
-  musikhack::lockfree::SoundLoader soundLoader;
+  musikhack::lockfree::Snapshot<Meters> meters;
+
+  VizRing vizRing;
+  LogQueue logQueue;
+  // Decoded files, so going back to one doesn't decode it again
+  std::shared_ptr<musikhack::lockfree::SampleCache> sampleCache =
+      std::make_shared<musikhack::lockfree::SampleCache>(64 * 1024 * 1024);
+  // ...and so the next session maps them back in instead of decoding
+  std::shared_ptr<musikhack::lockfree::DiskSampleCache> diskCache =
+      std::make_shared<musikhack::lockfree::DiskSampleCache>(
+          juce::File::getSpecialLocation(
+              juce::File::userApplicationDataDirectory)
+              .getChildFile("musikhack/LockfreeExample/SampleCache"));
+  // Declared before the loader, whose destructor waits for any build still
+  // reading through it
+  juce::AudioFormatManager formatManager;
+  // Every instance in the process shares one pool of loader threads
+  musikhack::lockfree::SharedSoundLoader soundLoader;
   std::unique_ptr<musikhack::lockfree::LoadableSound> loadedSound;
+  // A sound that's done with but didn't fit in the destroy queue yet. Never
+  // freed on the audio thread
+  std::unique_ptr<musikhack::lockfree::LoadableSound> soundToDestroy;
+  std::atomic<double> hostSampleRate = 0.0;
+  // Only touched on the message thread
+  musikhack::lockfree::LoadableSound::Options lastSoundOptions;
   //==============================================================================
   JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(LockfreeExampleProcessor)
 };
@@ -0,0 +1,114 @@
+#include "TestUtilities.h"
+#include <cmath>
+#include <juce_core/juce_core.h>
+#include <lockfree/lockfree.h>
+
+using namespace musikhack::lockfree;
+using testutils::makeSampleData;
+
+namespace {
+
+constexpr double rate = 48000.0;
+constexpr double twoPi = juce::MathConstants<double>::twoPi;
+
+// A decaying 180 Hz burst starting at each of hits, like a kick drum
+float kicks(const std::vector<int> &hits, int index) {
+  double sample = 0.0;
+  for (const auto hit : hits) {
+    if (index < hit)
+      continue;
+    const auto t = (index - hit) / rate;
+    sample += 0.8 * std::exp(-20.0 * t) * std::sin(twoPi * 180.0 * t);
+  }
+  return (float)sample;
+}
+
+class AnalysisTests : public juce::UnitTest {
+public:
+  AnalysisTests() : juce::UnitTest("SampleAnalysis", "Lockfree") {}
+
+  void runTest() override {
+    beginTest("Loudness of a -20 dBFS 997 Hz tone");
+    {
+      // BS.1770's reference: a full-scale 997 Hz sine in both channels of
+      // a stereo pair reads -3.01 LUFS, so this one reads -20
+      const auto tone = [](int, int index) {
+        return (float)(0.1 * std::sin(twoPi * 997.0 * index / rate));
+      };
+
+      const auto gated = makeSampleData(rate, 2, (int)rate * 5, tone);
+      expectWithinAbsoluteError(gated->getAnalysis()->getIntegratedLoudness(),
+                                -20.0, 0.05);
+
+      // Shorter than a 400 ms block, so measured as one
+      const auto hit = makeSampleData(rate, 2, (int)(rate * 0.1), tone);
+      expectWithinAbsoluteError(hit->getAnalysis()->getIntegratedLoudness(),
+                                -20.0, 0.05);
+    }
+
+    beginTest("True peak between samples");
+    {
+      // A quarter of the sample rate 45 degrees out lands every sample at
+      // 0.707 of the crest, so the sample peak is well short of the true one
+      const auto data = makeSampleData(rate, 1, 4800, [](int, int index) {
+        return (float)(0.5 * std::sin(twoPi * index / 4.0 + twoPi / 8.0));
+      });
+      const auto *analysis = data->getAnalysis();
+
+      expectWithinAbsoluteError(analysis->getPeak(), 0.3536f, 0.0005f);
+      expectWithinAbsoluteError(analysis->getTruePeak(), 0.5f, 0.01f);
+    }
+
+    beginTest("Silence");
+    {
+      const auto data =
+          makeSampleData(rate, 2, 4800, [](int, int) { return 0.0f; });
+      const auto *analysis = data->getAnalysis();
+
+      expectEquals(analysis->getPeak(), 0.0f);
+      expect(std::isinf(analysis->getIntegratedLoudness()));
+      expectEquals(analysis->getSoundStart(), 0);
+      expectEquals(analysis->getSoundEnd(), 0);
+      expect(analysis->getOnsets().empty());
+    }
+
+    beginTest("Onsets of hits on the frame grid");
+    {
+      // 24000 and 57600 are whole 5 ms frames in
+      const std::vector<int> hits{24000, 57600};
+      const auto data = makeSampleData(
+          rate, 1, (int)rate * 2,
+          [&](int, int index) { return kicks(hits, index); });
+      const auto *analysis = data->getAnalysis();
+
+      const auto &onsets = analysis->getOnsets();
+      expectEquals((int)onsets.size(), 2);
+      for (size_t i = 0; i < juce::jmin(onsets.size(), hits.size()); ++i)
+        expect(std::abs(onsets[i] - hits[i]) <= 1);
+
+      // The burst starts at zero, so the first audible sample is one on
+      expect(std::abs(analysis->getSoundStart() - hits.front()) <= 1);
+    }
+
+    beginTest("Onsets of hits between frames");
+    {
+      // Onsets are frame starts, so they're as close as a frame allows
+      const int frame = (int)(rate * 0.005);
+      for (const auto first : {24100, 24239}) {
+        const std::vector<int> hits{first, first + 33600};
+        const auto data = makeSampleData(
+            rate, 1, (int)rate * 2,
+            [&](int, int index) { return kicks(hits, index); });
+
+        const auto &onsets = data->getAnalysis()->getOnsets();
+        expectEquals((int)onsets.size(), 2);
+        for (size_t i = 0; i < juce::jmin(onsets.size(), hits.size()); ++i)
+          expect(std::abs(onsets[i] - hits[i]) <= frame);
+      }
+    }
+  }
+};
+
+static AnalysisTests analysisTests;
+
+} // namespace
@@ -0,0 +1,182 @@
+#include "TestUtilities.h"
+#include <cmath>
+#include <cstring>
+#include <juce_core/juce_core.h>
+#include <lockfree/lockfree.h>
+
+using namespace musikhack::lockfree;
+using testutils::makeSampleData;
+
+namespace {
+
+// Half a second of a tone that differs between channels and gets louder
+// halfway
+std::shared_ptr<SampleData> makeTestData() {
+  return makeSampleData(48000.0, 2, 24000, [](int channel, int index) {
+    const auto tone = 0.25 * std::sin(0.01 * (channel + 1) * index);
+    return (float)(index < 12000 ? tone : 2.0 * tone);
+  });
+}
+
+SampleCache::Key makeKey(const juce::String &path) {
+  return {path, 123456, 1700000000000, 48000.0, false};
+}
+
+juce::Array<juce::File> findEntries(const juce::File &directory) {
+  return directory.findChildFiles(juce::File::findFiles, false, "*.samples");
+}
+
+class DiskSampleCacheTests : public juce::UnitTest {
+public:
+  DiskSampleCacheTests() : juce::UnitTest("DiskSampleCache", "Lockfree") {}
+
+  void runTest() override {
+    const auto directory =
+        juce::File::getSpecialLocation(juce::File::tempDirectory)
+            .getNonexistentChildFile("DiskSampleCacheTests", "", false);
+
+    beginTest("Store and load round trip");
+    {
+      DiskSampleCache cache(directory);
+      const auto data = makeTestData();
+      const auto key = makeKey("/samples/round-trip.wav");
+
+      expect(!cache.contains(key));
+      expect(cache.load(key) == nullptr);
+      expect(cache.store(key, *data));
+      expect(cache.contains(key));
+
+      const auto loaded = cache.load(key);
+      expect(loaded != nullptr);
+      if (loaded != nullptr) {
+        expectEquals(loaded->sampleRate, data->sampleRate);
+        expectEquals(loaded->getNumChannels(), data->getNumChannels());
+        expectEquals(loaded->getNumSamples(), data->getNumSamples());
+        expectEquals(loaded->numSamplesReady.load(), data->getNumSamples());
+        expect(loaded->getNumBytes() == data->getNumBytes());
+        expect(std::memcmp(loaded->getFirstSample(), data->getFirstSample(),
+                           data->getNumBytes()) == 0);
+
+        expect(loaded->getOverview() != nullptr);
+        const auto *stored = loaded->getAnalysis();
+        const auto *original = data->getAnalysis();
+        expect(stored != nullptr);
+        if (stored != nullptr) {
+          expectEquals(stored->getPeak(), original->getPeak());
+          expectEquals(stored->getTruePeak(), original->getTruePeak());
+          expectEquals(stored->getIntegratedLoudness(),
+                       original->getIntegratedLoudness());
+          expectEquals(stored->getSoundStart(), original->getSoundStart());
+          expectEquals(stored->getSoundEnd(), original->getSoundEnd());
+          expect(stored->getOnsets() == original->getOnsets());
+        }
+      }
+    }
+
+    beginTest("Compact storage round trip");
+    {
+      DiskSampleCache cache(directory);
+      auto data = makeTestData();
+      data->pack(SampleData::Storage::int16);
+      auto key = makeKey("/samples/compact.wav");
+      key.compact = true;
+
+      expect(cache.store(key, *data));
+      const auto loaded = cache.load(key);
+      expect(loaded != nullptr);
+      if (loaded != nullptr) {
+        expect(loaded->getNumBytes() == data->getNumBytes());
+        expect(std::memcmp(loaded->getFirstSample(), data->getFirstSample(),
+                           data->getNumBytes()) == 0);
+      }
+
+      // Kept apart from the same file decoded to floats
+      key.compact = false;
+      expect(!cache.contains(key));
+    }
+
+    beginTest("An edited source misses");
+    {
+      DiskSampleCache cache(directory);
+      const auto key = makeKey("/samples/edited.wav");
+      expect(cache.store(key, *makeTestData()));
+
+      auto edited = key;
+      edited.modified += 1000;
+      expect(!cache.contains(edited));
+      expect(cache.load(edited) == nullptr);
+
+      auto resized = key;
+      resized.size += 1;
+      expect(!cache.contains(resized));
+      expect(cache.load(resized) == nullptr);
+
+      // Storing the edit writes over the old entry
+      expect(cache.store(edited, *makeTestData()));
+      expect(cache.contains(edited));
+      expect(!cache.contains(key));
+    }
+
+    beginTest("A damaged entry misses");
+    {
+      const auto subdirectory = directory.getChildFile("damaged");
+      DiskSampleCache cache(subdirectory);
+      const auto key = makeKey("/samples/damaged.wav");
+      expect(cache.store(key, *makeTestData()));
+
+      const auto entries = findEntries(subdirectory);
+      expectEquals(entries.size(), 1);
+      const auto entry = entries[0];
+      juce::MemoryBlock bytes;
+      expect(entry.loadFileAsData(bytes));
+
+      // Cut short
+      expect(entry.replaceWithData(bytes.getData(), bytes.getSize() - 1));
+      expect(cache.load(key) == nullptr);
+
+      // Wrong magic
+      auto garbled = bytes;
+      static_cast<char *>(garbled.getData())[0] = 'X';
+      expect(entry.replaceWithData(garbled.getData(), garbled.getSize()));
+      expect(!cache.contains(key));
+      expect(cache.load(key) == nullptr);
+
+      // Put back whole, it loads again
+      expect(entry.replaceWithData(bytes.getData(), bytes.getSize()));
+      expect(cache.load(key) != nullptr);
+    }
+
+    beginTest("Prune keeps the most recently used");
+    {
+      const auto subdirectory = directory.getChildFile("pruned");
+      const auto older = makeKey("/samples/older.wav");
+      const auto newer = makeKey("/samples/newer.wav");
+      {
+        DiskSampleCache unlimited(subdirectory);
+        expect(unlimited.store(older, *makeTestData()));
+        expect(unlimited.store(newer, *makeTestData()));
+      }
+
+      const auto files = findEntries(subdirectory);
+      expectEquals(files.size(), 2);
+      const auto entrySize = files[0].getSize();
+
+      // Room for one entry, so the older one goes
+      DiskSampleCache cache(subdirectory, entrySize);
+      const juce::Time anHourAgo(juce::Time::currentTimeMillis() - 3600000);
+      for (const auto &file : files)
+        file.setLastModificationTime(anHourAgo);
+      expect(cache.load(newer) != nullptr);
+
+      cache.prune();
+      expect(cache.contains(newer));
+      expect(!cache.contains(older));
+    }
+
+    directory.deleteRecursively();
+  }
+};
+
+static DiskSampleCacheTests diskSampleCacheTests;
+
+} // namespace
@@ -0,0 +1,23 @@
+/*
+  ==============================================================================
+
+    Unit and stress tests for the lockfree module. Each test registers itself
+    in the "Lockfree" category. Runs them all and exits non-zero if any
+    expectation failed, so it can run under ctest.
+
+  ==============================================================================
+*/
+
+#include <juce_core/juce_core.h>
+
+int main() {
+  juce::UnitTestRunner runner;
+  runner.setAssertOnFailure(false);
+  runner.runTestsInCategory("Lockfree");
+
+  int numFailures = 0;
+  for (int i = 0; i < runner.getNumResults(); ++i)
+    numFailures += runner.getResult(i)->failures;
+
+  return numFailures > 0 ? 1 : 0;
+}
@@ -0,0 +1,95 @@
+#include "TestUtilities.h"
+#include <juce_core/juce_core.h>
+#include <lockfree/lockfree.h>
+#include <thread>
+#include <vector>
+
+using namespace musikhack::lockfree;
+
+namespace {
+
+class MpscQueueTests : public juce::UnitTest {
+public:
+  MpscQueueTests() : juce::UnitTest("MpscQueue", "Lockfree") {}
+
+  void runTest() override {
+    beginTest("Empty and full");
+    {
+      MpscQueue<int> queue(4);
+      int out = 0;
+      expect(!queue.pop(out));
+      for (int i = 0; i < 4; ++i)
+        expect(queue.push(i));
+      expect(!queue.push(4), "pushed into a full queue");
+
+      for (int i = 0; i < 4; ++i) {
+        expect(queue.pop(out));
+        expectEquals(out, i);
+      }
+      expect(!queue.pop(out));
+    }
+
+    beginTest("Wraparound");
+    {
+      // Three at a time through four cells, so every lap starts somewhere
+      // new
+      MpscQueue<int> queue(4);
+      int out = 0, next = 0, expected = 0;
+      for (int round = 0; round < 1000; ++round) {
+        for (int i = 0; i < 3; ++i)
+          expect(queue.push(next++));
+        for (int i = 0; i < 3; ++i) {
+          expect(queue.pop(out));
+          expectEquals(out, expected++);
+        }
+      }
+      expect(!queue.pop(out));
+    }
+
+    beginTest("Multiple producers stress");
+    {
+      constexpr int numProducers = 4;
+      constexpr juce::uint32 perProducer = 200000;
+      struct Item {
+        juce::uint32 producer;
+        juce::uint32 sequence;
+      };
+      MpscQueue<Item> queue(128);
+
+      std::vector<std::thread> producers;
+      for (juce::uint32 p = 0; p < numProducers; ++p)
+        producers.emplace_back([&queue, p] {
+          for (juce::uint32 i = 0; i < perProducer; ++i)
+            while (!queue.push({p, i}))
+              testutils::backOff();
+        });
+
+      // Each producer's items arrive in its own order, whatever the
+      // interleaving
+      std::vector<juce::uint32> next(numProducers, 0);
+      int outOfOrder = 0;
+      juce::uint64 received = 0;
+      Item item;
+      while (received < (juce::uint64)numProducers * perProducer) {
+        if (!queue.pop(item)) {
+          testutils::backOff();
+          continue;
+        }
+        outOfOrder += item.sequence == next[item.producer] ? 0 : 1;
+        next[item.producer] = item.sequence + 1;
+        ++received;
+      }
+
+      for (auto &producer : producers)
+        producer.join();
+
+      expectEquals(outOfOrder, 0);
+      for (auto count : next)
+        expectEquals((int)count, (int)perProducer);
+    }
+  }
+};
+
+MpscQueueTests mpscQueueTests;
+
+} // namespace
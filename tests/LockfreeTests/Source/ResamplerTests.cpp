@@ -0,0 +1,105 @@
+#include "TestUtilities.h"
+#include <cmath>
+#include <juce_core/juce_core.h>
+#include <lockfree/lockfree.h>
+#include <vector>
+
+using namespace musikhack::lockfree;
+
+namespace {
+
+constexpr double twoPi = juce::MathConstants<double>::twoPi;
+
+std::vector<float> sine(double frequency, double rate, int numSamples) {
+  std::vector<float> samples((size_t)numSamples);
+  for (int i = 0; i < numSamples; ++i)
+    samples[(size_t)i] = (float)(0.5 * std::sin(twoPi * frequency * i / rate));
+  return samples;
+}
+
+std::vector<float> resample(const std::vector<float> &input, double from,
+                            double to) {
+  detail::PolyphaseResampler resampler(from, to);
+  std::vector<float> output(
+      (size_t)resampler.getNumOutputSamples((int)input.size()));
+  resampler.process(input.data(), (int)input.size(), output.data(),
+                    (int)output.size());
+  return output;
+}
+
+// RMS of output less expected, in dB relative to expected's RMS, leaving
+// out margin samples at each end where the filter runs off the input
+double errorDb(const std::vector<float> &output,
+               const std::vector<float> &expected, int margin) {
+  double error = 0.0, signal = 0.0;
+  for (size_t i = (size_t)margin; i + (size_t)margin < output.size(); ++i) {
+    const double difference = (double)output[i] - expected[i];
+    error += difference * difference;
+    signal += (double)expected[i] * expected[i];
+  }
+  return 10.0 * std::log10(error / signal);
+}
+
+// RMS level in dB relative to a 0.5 amplitude sine, leaving out margin
+// samples at each end
+double levelDb(const std::vector<float> &output, int margin) {
+  double sum = 0.0;
+  int count = 0;
+  for (size_t i = (size_t)margin; i + (size_t)margin < output.size(); ++i) {
+    sum += (double)output[i] * output[i];
+    ++count;
+  }
+  return 10.0 * std::log10(sum / count / 0.125);
+}
+
+class ResamplerTests : public juce::UnitTest {
+public:
+  ResamplerTests() : juce::UnitTest("PolyphaseResampler", "Lockfree") {}
+
+  void runTest() override {
+    const int margin =
+        detail::PolyphaseResampler(44100.0, 48000.0).getNumTaps() * 2;
+
+    beginTest("Output length");
+    {
+      detail::PolyphaseResampler up(44100.0, 48000.0), down(48000.0, 44100.0);
+      expectEquals(up.getNumOutputSamples(44100), 48000);
+      expectEquals(down.getNumOutputSamples(48000), 44100);
+      expectEquals(detail::PolyphaseResampler(48000.0, 48000.0)
+                       .getNumOutputSamples(1000),
+                   1000);
+    }
+
+    beginTest("A 1 kHz tone each way");
+    {
+      const auto up = resample(sine(1000.0, 44100.0, 44100), 44100.0, 48000.0);
+      expectLessThan(errorDb(up, sine(1000.0, 48000.0, 48000), margin),
+                     -110.0);
+
+      const auto down =
+          resample(sine(1000.0, 48000.0, 48000), 48000.0, 44100.0);
+      expectLessThan(errorDb(down, sine(1000.0, 44100.0, 44100), margin),
+                     -110.0);
+    }
+
+    beginTest("Round trip");
+    {
+      const auto original = sine(1000.0, 44100.0, 44100);
+      const auto back =
+          resample(resample(original, 44100.0, 48000.0), 48000.0, 44100.0);
+      expectLessThan(errorDb(back, original, margin * 2), -110.0);
+    }
+
+    beginTest("Rejects what's above the target's Nyquist");
+    {
+      // 23 kHz is out of 44.1k's band, so all that's left is aliasing
+      const auto aliased =
+          resample(sine(23000.0, 48000.0, 48000), 48000.0, 44100.0);
+      expectLessThan(levelDb(aliased, margin), -110.0);
+    }
+  }
+};
+
+static ResamplerTests resamplerTests;
+
+} // namespace
@@ -0,0 +1,126 @@
+#include "TestUtilities.h"
+#include <juce_core/juce_core.h>
+#include <lockfree/lockfree.h>
+
+using namespace musikhack::lockfree;
+using testutils::makeSampleData;
+
+namespace {
+
+// 1000 float samples of silence, 4000 bytes
+SampleData::Ptr makeEntry() {
+  return makeSampleData(48000.0, 1, 1000, [](int, int) { return 0.0f; });
+}
+
+SampleCache::Key makeKey(const juce::String &path) {
+  return {path, 1000, 0, 48000.0, false};
+}
+
+class SampleCacheTests : public juce::UnitTest {
+public:
+  SampleCacheTests() : juce::UnitTest("SampleCache", "Lockfree") {}
+
+  void runTest() override {
+    const auto a = makeKey("a.wav"), b = makeKey("b.wav"),
+               c = makeKey("c.wav"), d = makeKey("d.wav");
+
+    beginTest("Hits and misses");
+    {
+      SampleCache cache;
+      const auto entry = makeEntry();
+      expect(cache.find(a) == nullptr);
+      cache.insert(a, entry);
+      expect(cache.find(a) == entry);
+      expect(cache.find(b) == nullptr);
+
+      expectEquals((int)cache.getNumHits(), 1);
+      expectEquals((int)cache.getNumMisses(), 2);
+      expectEquals((int)cache.getNumEntries(), 1);
+      expectEquals((int)cache.getNumBytes(), 4000);
+
+      // Anything that would have decoded differently is a different key
+      auto modified = a;
+      modified.modified = 1;
+      auto resampled = a;
+      resampled.sampleRate = 44100.0;
+      auto compact = a;
+      compact.compact = true;
+      expect(cache.find(modified) == nullptr);
+      expect(cache.find(resampled) == nullptr);
+      expect(cache.find(compact) == nullptr);
+    }
+
+    beginTest("Least recently used goes first");
+    {
+      // Room for three
+      SampleCache cache(12000);
+      cache.insert(a, makeEntry());
+      cache.insert(b, makeEntry());
+      cache.insert(c, makeEntry());
+      expectEquals((int)cache.getNumEntries(), 3);
+
+      // A hit makes a the most recently used, so b is evicted for d
+      expect(cache.find(a) != nullptr);
+      cache.insert(d, makeEntry());
+      expectEquals((int)cache.getNumEntries(), 3);
+      expectEquals((int)cache.getNumBytes(), 12000);
+      expect(cache.find(b) == nullptr);
+      expect(cache.find(a) != nullptr);
+      expect(cache.find(c) != nullptr);
+      expect(cache.find(d) != nullptr);
+    }
+
+    beginTest("Inserting a key again replaces it");
+    {
+      SampleCache cache(12000);
+      cache.insert(a, makeEntry());
+      cache.insert(b, makeEntry());
+      const auto replacement = makeEntry();
+      cache.insert(a, replacement);
+
+      expectEquals((int)cache.getNumEntries(), 2);
+      expectEquals((int)cache.getNumBytes(), 8000);
+      expect(cache.find(a) == replacement);
+
+      // And makes it the most recently used
+      cache.insert(c, makeEntry());
+      cache.insert(d, makeEntry());
+      expect(cache.find(b) == nullptr);
+      expect(cache.find(a) == replacement);
+    }
+
+    beginTest("Shrinking the budget evicts");
+    {
+      SampleCache cache(12000);
+      cache.insert(a, makeEntry());
+      cache.insert(b, makeEntry());
+      cache.insert(c, makeEntry());
+
+      cache.setBudget(4000);
+      expectEquals((int)cache.getBudget(), 4000);
+      expectEquals((int)cache.getNumEntries(), 1);
+      expectEquals((int)cache.getNumBytes(), 4000);
+      expect(cache.find(c) != nullptr);
+
+      cache.setBudget(0);
+      expectEquals((int)cache.getNumEntries(), 0);
+      expectEquals((int)cache.getNumBytes(), 0);
+    }
+
+    beginTest("Evicted data lives on while it's held");
+    {
+      SampleCache cache(4000);
+      auto held = makeEntry();
+      cache.insert(a, held);
+      cache.insert(b, makeEntry());
+
+      expect(cache.find(a) == nullptr);
+      expectEquals(held.use_count(), 1L);
+      expectEquals(held->getNumSamples(), 1000);
+    }
+  }
+};
+
+static SampleCacheTests sampleCacheTests;
+
+} // namespace
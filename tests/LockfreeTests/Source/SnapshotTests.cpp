@@ -0,0 +1,73 @@
+#include "TestUtilities.h"
+#include <atomic>
+#include <juce_core/juce_core.h>
+#include <lockfree/lockfree.h>
+#include <thread>
+
+using namespace musikhack::lockfree;
+using testutils::Stamped;
+
+namespace {
+
+class SnapshotTests : public juce::UnitTest {
+public:
+  SnapshotTests() : juce::UnitTest("Snapshot", "Lockfree") {}
+
+  void runTest() override {
+    beginTest("Reads see the latest publish");
+    {
+      Snapshot<int> snapshot(-1);
+      expect(!snapshot.hasNewData());
+      expectEquals(snapshot.read(), -1);
+
+      snapshot.publish(1);
+      expect(snapshot.hasNewData());
+      expectEquals(snapshot.read(), 1);
+      expect(!snapshot.hasNewData());
+      expectEquals(snapshot.read(), 1);
+
+      // Only the newest of several publishes is seen
+      snapshot.publish(2);
+      snapshot.publish(3);
+      snapshot.getWriteBuffer() = 4;
+      snapshot.publish();
+      expectEquals(snapshot.read(), 4);
+    }
+
+    beginTest("Publish and read stress");
+    {
+      // The reader never sees a torn value or one older than it's seen
+      // already, and sees the last one once the writer stops
+      constexpr juce::uint64 numPublishes = 500000;
+      Snapshot<Stamped> snapshot(Stamped::make(0));
+      std::atomic<bool> done{false};
+
+      std::thread writer([&] {
+        for (juce::uint64 n = 1; n <= numPublishes; ++n) {
+          snapshot.getWriteBuffer() = Stamped::make(n);
+          snapshot.publish();
+        }
+        done = true;
+      });
+
+      int torn = 0, stale = 0;
+      juce::uint64 last = 0;
+      while (!done.load()) {
+        const auto &value = snapshot.read();
+        torn += value.isIntact() ? 0 : 1;
+        stale += value.sequence >= last ? 0 : 1;
+        last = value.sequence;
+      }
+      writer.join();
+
+      expectEquals(torn, 0);
+      expectEquals(stale, 0);
+      expect(snapshot.read().sequence == numPublishes,
+             "the last publish was never seen");
+    }
+  }
+};
+
+SnapshotTests snapshotTests;
+
+} // namespace
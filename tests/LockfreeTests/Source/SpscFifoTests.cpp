@@ -0,0 +1,228 @@
+#include "TestUtilities.h"
+#include <atomic>
+#include <juce_core/juce_core.h>
+#include <lockfree/lockfree.h>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace musikhack::lockfree;
+using testutils::Stamped;
+
+namespace {
+
+class SpscFifoTests : public juce::UnitTest {
+public:
+  SpscFifoTests() : juce::UnitTest("SpscFifo", "Lockfree") {}
+
+  void runTest() override {
+    beginTest("Empty and full");
+    {
+      detail::SpscFifo<int> fifo(4);
+      expectEquals((int)fifo.getCapacity(), 4);
+
+      int out = 0;
+      expect(!fifo.pop(out), "popped from an empty FIFO");
+
+      for (int i = 0; i < 4; ++i)
+        expect(fifo.emplace(i));
+      expect(!fifo.emplace(4), "pushed into a full FIFO");
+      expectEquals((int)fifo.getNumReady(), 4);
+
+      for (int i = 0; i < 4; ++i) {
+        expect(fifo.pop(out));
+        expectEquals(out, i);
+      }
+      expect(!fifo.pop(out));
+    }
+
+    beginTest("Capacity rounds up to a power of two");
+    {
+      detail::SpscFifo<int> fifo(5);
+      expectEquals((int)fifo.getCapacity(), 8);
+    }
+
+    beginTest("Wraparound with bulk reads and writes");
+    {
+      Queue<int> queue(8);
+      auto &random = getRandom();
+      int next = 0, expected = 0;
+      std::vector<int> in(8), out(8);
+
+      // Hundreds of laps, with runs that straddle the end of the storage
+      for (int round = 0; round < 2000; ++round) {
+        const auto numIn = (size_t)random.nextInt(9);
+        for (size_t i = 0; i < numIn; ++i)
+          in[i] = next + (int)i;
+        const auto written = queue.pushN(in.data(), numIn);
+        next += (int)written;
+
+        const auto numRead = queue.popN(out.data(), (size_t)random.nextInt(9));
+        for (size_t i = 0; i < numRead; ++i)
+          expectEquals(out[i], expected++);
+      }
+
+      int last = 0;
+      while (queue.pop(last))
+        expectEquals(last, expected++);
+      expectEquals(expected, next);
+    }
+
+    beginTest("Reserve and commit");
+    {
+      Queue<std::string> queue(2);
+      *queue.reserve() = "first";
+      queue.commit();
+      *queue.reserve() = "second";
+      queue.commit();
+      expect(queue.reserve() == nullptr, "reserved a slot in a full queue");
+
+      std::string out;
+      expect(queue.pop(out) && out == "first");
+      expect(queue.peek() != nullptr && *queue.peek() == "second");
+      queue.release();
+      expect(queue.peek() == nullptr);
+    }
+
+    beginTest("Pushes move, and items left behind are destroyed");
+    {
+      auto tracked = std::make_shared<int>(0);
+      {
+        Queue<std::shared_ptr<int>> queue(4);
+        queue.push(tracked);
+        auto moved = tracked;
+        queue.push(std::move(moved));
+        expect(moved == nullptr, "push(T &&) copied instead of moving");
+        expectEquals((int)tracked.use_count(), 3);
+      }
+      expectEquals((int)tracked.use_count(), 1);
+    }
+
+    beginTest("Overwrite oldest keeps the newest");
+    {
+      Ring<int, Overflow::overwriteOldest> ring(4);
+      for (int i = 0; i < 10; ++i)
+        expect(ring.push(i), "an overwriting push failed");
+      expectEquals((int)ring.takeNumDropped(), 6);
+      expectEquals((int)ring.takeNumDropped(), 0);
+
+      int out = 0;
+      for (int i = 6; i < 10; ++i) {
+        expect(ring.pop(out));
+        expectEquals(out, i);
+      }
+      expect(!ring.pop(out));
+
+      // A block bigger than the ring only leaves its tail
+      const int block[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+      expectEquals((int)ring.pushN(block, 10), 4);
+      expectEquals((int)ring.takeNumDropped(), 6);
+      int last = -1;
+      ring.forLast([&](int v) { last = v; });
+      expectEquals(last, 9);
+    }
+
+    beginTest("StaticRing keeps its slots inline");
+    {
+      StaticRing<int, 8> ring;
+      expectEquals((int)ring.getSize(), 8);
+      expect(sizeof(ring) >= 8 * sizeof(int) + 2 * detail::cacheLineSize,
+             "the slots or padded indices aren't inside the ring");
+
+      // Odd-sized laps, so reads and writes land everywhere in the storage
+      int out = 0, next = 0, expected = 0;
+      for (int round = 0; round < 1000; ++round) {
+        for (int i = 0; i < 5; ++i)
+          expect(ring.push(next++));
+        for (int i = 0; i < 5; ++i) {
+          expect(ring.pop(out));
+          expectEquals(out, expected++);
+        }
+      }
+      for (int i = 0; i < 8; ++i)
+        expect(ring.push(i));
+      expect(!ring.push(8), "pushed into a full ring");
+    }
+
+    beginTest("Single producer, single consumer stress");
+    {
+      constexpr juce::uint64 numItems = 1000000;
+      Queue<juce::uint64> queue(64);
+      std::atomic<int> errors{0};
+
+      std::thread producer([&] {
+        for (juce::uint64 i = 0; i < numItems; ++i)
+          while (!queue.push(i))
+            testutils::backOff();
+      });
+
+      juce::uint64 expected = 0, item;
+      while (expected < numItems) {
+        if (!queue.pop(item)) {
+          testutils::backOff();
+          continue;
+        }
+        if (item != expected++)
+          ++errors;
+      }
+
+      producer.join();
+      expectEquals(errors.load(), 0);
+    }
+
+    beginTest("Overwrite oldest stress");
+    {
+      // The producer laps the consumer all the time. Every item that comes
+      // out must be whole and newer than the last, and nothing may go
+      // missing without being counted as dropped
+      constexpr juce::uint64 numItems = 500000;
+      StaticRing<Stamped, 64, Overflow::overwriteOldest> ring;
+      std::atomic<bool> done{false};
+
+      std::thread producer([&] {
+        Stamped block[16];
+        for (juce::uint64 n = 0; n < numItems;) {
+          const auto count = (size_t)juce::jmin<juce::uint64>(
+              1 + n % 16, numItems - n);
+          for (size_t i = 0; i < count; ++i)
+            block[i] = Stamped::make(n + i);
+          ring.pushN(block, count);
+          n += count;
+        }
+        done = true;
+      });
+
+      juce::uint64 received = 0, dropped = 0;
+      juce::int64 last = -1;
+      int torn = 0, outOfOrder = 0;
+      Stamped out[8];
+      for (;;) {
+        const auto finished = done.load();
+        size_t count;
+        while ((count = ring.popN(out, 8)) > 0) {
+          for (size_t i = 0; i < count; ++i) {
+            torn += out[i].isIntact() ? 0 : 1;
+            outOfOrder += (juce::int64)out[i].sequence > last ? 0 : 1;
+            last = (juce::int64)out[i].sequence;
+          }
+          received += count;
+        }
+        dropped += ring.takeNumDropped();
+        if (finished)
+          break;
+      }
+
+      producer.join();
+      expectEquals(torn, 0);
+      expectEquals(outOfOrder, 0);
+      expectEquals(last, (juce::int64)numItems - 1);
+      expect(received + dropped == numItems,
+             "items went missing without being counted as dropped");
+    }
+  }
+};
+
+SpscFifoTests spscFifoTests;
+
+} // namespace
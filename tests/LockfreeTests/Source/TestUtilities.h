@@ -0,0 +1,47 @@
+#pragma once
+
+#include <functional>
+#include <juce_core/juce_core.h>
+#include <lockfree/lockfree.h>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace testutils {
+
+// Back off when a queue is full or empty, so a spinning thread doesn't
+// starve its partner on a machine with few cores
+inline void backOff() { std::this_thread::yield(); }
+
+// Two copies of a sequence number, so a torn read shows up as a mismatch
+struct Stamped {
+  juce::uint64 sequence = 0;
+  juce::uint64 inverse = ~(juce::uint64)0;
+
+  static Stamped make(juce::uint64 n) { return {n, ~n}; }
+  bool isIntact() const { return inverse == ~sequence; }
+};
+
+// Float data at rate with every sample from generate(channel, index), all
+// of it ready and complete()d, as a finished load leaves it
+inline std::shared_ptr<musikhack::lockfree::SampleData>
+makeSampleData(double rate, int channels, int samples,
+               const std::function<float(int, int)> &generate) {
+  using musikhack::lockfree::SampleData;
+  auto data = std::make_shared<SampleData>();
+  data->sampleRate = rate;
+  data->allocate(SampleData::Storage::float32, channels, samples);
+
+  std::vector<float> channelSamples((size_t)samples);
+  for (int channel = 0; channel < channels; ++channel) {
+    for (int i = 0; i < samples; ++i)
+      channelSamples[(size_t)i] = generate(channel, i);
+    data->write(channel, 0, channelSamples.data(), samples);
+  }
+
+  data->numSamplesReady.store(samples);
+  data->complete();
+  return data;
+}
+
+} // namespace testutils
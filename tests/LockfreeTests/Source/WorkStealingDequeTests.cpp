@@ -0,0 +1,107 @@
+#include "TestUtilities.h"
+#include <atomic>
+#include <juce_core/juce_core.h>
+#include <lockfree/lockfree.h>
+#include <thread>
+#include <vector>
+
+using namespace musikhack::lockfree;
+
+namespace {
+
+class WorkStealingDequeTests : public juce::UnitTest {
+public:
+  WorkStealingDequeTests()
+      : juce::UnitTest("WorkStealingDeque", "Lockfree") {}
+
+  void runTest() override {
+    beginTest("Owner pops newest, thieves steal oldest");
+    {
+      detail::WorkStealingDeque<int> deque(4);
+      for (int i = 0; i < 4; ++i)
+        expect(deque.push(i));
+      expect(!deque.push(4), "pushed into a full deque");
+
+      int out = -1;
+      expect(deque.steal(out));
+      expectEquals(out, 0);
+      expect(deque.pop(out));
+      expectEquals(out, 3);
+      expect(deque.steal(out));
+      expectEquals(out, 1);
+      expect(deque.pop(out));
+      expectEquals(out, 2);
+      expect(!deque.pop(out));
+      expect(!deque.steal(out));
+    }
+
+    beginTest("Wraparound");
+    {
+      detail::WorkStealingDeque<int> deque(4);
+      int out = -1;
+      for (int i = 0; i < 1000; ++i) {
+        expect(deque.push(2 * i));
+        expect(deque.push(2 * i + 1));
+        expect(deque.steal(out));
+        expectEquals(out, 2 * i);
+        expect(deque.pop(out));
+        expectEquals(out, 2 * i + 1);
+      }
+      expect(!deque.pop(out));
+    }
+
+    beginTest("Steal against pop stress");
+    {
+      // Every item is taken exactly once, by the owner or a thief, even
+      // when they race for the last one
+      constexpr int numItems = 200000;
+      constexpr int numThieves = 3;
+      detail::WorkStealingDeque<int> deque(64);
+      std::vector<std::atomic<int>> taken(numItems);
+      for (auto &count : taken)
+        count = 0;
+      std::atomic<bool> done{false};
+
+      std::vector<std::thread> thieves;
+      for (int t = 0; t < numThieves; ++t)
+        thieves.emplace_back([&] {
+          int item;
+          while (!done.load()) {
+            if (deque.steal(item))
+              ++taken[(size_t)item];
+            else
+              testutils::backOff();
+          }
+        });
+
+      int item;
+      for (int i = 0; i < numItems; ++i) {
+        while (!deque.push(i)) {
+          if (deque.pop(item))
+            ++taken[(size_t)item];
+        }
+        // Keep the deque short, so pops and steals meet at the last item
+        if (i % 2 == 0 && deque.pop(item))
+          ++taken[(size_t)item];
+      }
+      while (deque.pop(item))
+        ++taken[(size_t)item];
+
+      done = true;
+      for (auto &thief : thieves)
+        thief.join();
+
+      int missing = 0, duplicated = 0;
+      for (auto &count : taken) {
+        missing += count.load() == 0 ? 1 : 0;
+        duplicated += count.load() > 1 ? 1 : 0;
+      }
+      expectEquals(missing, 0);
+      expectEquals(duplicated, 0);
+    }
+  }
+};
+
+WorkStealingDequeTests workStealingDequeTests;
+
+} // namespace